@@ -38,3 +38,13 @@
 #define RETURN_MOD_INIT_ERROR return
 #define RETURN_MOD_INIT_SUCCESS(modvar) return
 #endif
+
+#if PY_MAJOR_VERSION < 3
+typedef long Py_hash_t;
+#endif
+
+// Multi-phase module initialization (PEP 489) lets each (sub)interpreter
+// get its own, independent copy of the module and its heap types.
+#if PY_VERSION_HEX >= 0x03050000
+#define HAVE_MULTI_PHASE_INIT 1
+#endif
@@ -5,19 +5,419 @@
  */
 
 #include <Python.h>
+#include <pythread.h>
+#include <limits.h>
+#include <string.h>
 #include "pycompat.h"
 #include "xxhash.h"
 
+// Inputs smaller than this are hashed without releasing the GIL; for
+// them the cost of dropping and re-taking it outweighs the hashing.
+#define HASHXX_GIL_MINSIZE 2048
+
+
+// Usage statistics
+//
+// Counters live in a per-thread block, so recording never contends
+// between threads; blocks are linked into a global list the first time
+// a thread records anything and are summed when stats() is read. A
+// thread's block is kept after it exits so its counts aren't lost.
+//
+// Recording is off until enable_stats() is called, and every recording
+// site is guarded by a single test of stats_enabled. Building with
+// PYHASHXX_NO_STATS defined compiles the recording sites out entirely.
+
+enum {
+    STATS_HASHXX_FAST,      // hashxx() with one bytes-like argument
+    STATS_HASHXX_SLOW,      // hashxx() through XXH32_init/_update_hash
+    STATS_HASHXX_UPDATE,    // Hashxx.update()
+    STATS_HASHXX_DIGEST,    // Hashxx.digest()
+    STATS_HASHXX_UPDATE_FROM, // Hashxx.update_from()
+    STATS_HASH_STREAM,      // hash_stream()
+    STATS_HASH_WINDOWS,     // hash_windows()
+    STATS_HASH_BLOCKS,      // hash_blocks()
+    STATS_VERIFY_BLOCKS,    // verify_blocks()
+    STATS_BUILD_INDEX,      // build_index()
+    STATS_INDEX_LOOKUP,     // HashIndex lookups, counted per key
+    STATS_SKETCH_ADD,       // CountMinSketch.add() and add_many()
+    STATS_TOPK_ADD,         // TopK.add() and add_many()
+    STATS_KEY,              // Key() and Key.many()
+    STATS_ENTRIES
+};
+
+static const char* stats_entry_names[STATS_ENTRIES] = {
+    "hashxx.fast",
+    "hashxx.slow",
+    "Hashxx.update",
+    "Hashxx.digest",
+    "Hashxx.update_from",
+    "hash_stream",
+    "hash_windows",
+    "hash_blocks",
+    "verify_blocks",
+    "build_index",
+    "HashIndex.lookup",
+    "CountMinSketch.add",
+    "TopK.add",
+    "Key",
+};
+
+enum {
+    STATS_KERNEL_XXH32,
+    STATS_KERNEL_XXH32_UPDATE,
+    STATS_KERNEL_XXH32_DIGEST,
+    STATS_KERNEL_XXH32_WINDOWS,
+    STATS_KERNELS
+};
+
+static const char* stats_kernel_names[STATS_KERNELS] = {
+    "XXH32",
+    "XXH32_update",
+    "XXH32_digest",
+    "XXH32_windows",
+};
+
+// Input sizes are bucketed by bit length: bucket 0 counts empty
+// inputs, bucket k counts sizes in [2**(k-1), 2**k).
+#define STATS_SIZE_BUCKETS 64
+
+typedef struct HashxxStats {
+    unsigned long long calls[STATS_ENTRIES];
+    unsigned long long bytes[STATS_ENTRIES];
+    unsigned long long sizes[STATS_SIZE_BUCKETS];
+    unsigned long long kernels[STATS_KERNELS];
+    unsigned long long gil_released_ns;
+    struct HashxxStats* next;
+} HashxxStats;
+
+#ifndef PYHASHXX_NO_STATS
+
+#if defined(_MSC_VER)
+#  define HASHXX_THREAD_LOCAL __declspec(thread)
+#else
+#  define HASHXX_THREAD_LOCAL __thread
+#endif
+
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <pthread.h>
+#  include <time.h>
+#endif
+
+static int stats_enabled = 0;
+static HashxxStats* stats_all = NULL;
+// Counts of threads that have exited
+static HashxxStats stats_retired;
+static PyThread_type_lock stats_lock = NULL;
+static HASHXX_THREAD_LOCAL HashxxStats* stats_local = NULL;
+
+// A thread's block is retired by an OS thread-exit destructor, so that
+// threads coming and going don't grow stats_all without bound.
+#ifdef _WIN32
+static DWORD stats_key = FLS_OUT_OF_INDEXES;
+#else
+static pthread_key_t stats_key;
+static int stats_key_created = 0;
+#endif
+
+static void
+_stats_add(HashxxStats* total, const HashxxStats* stats)
+{
+    int i;
+
+    for (i = 0; i < STATS_ENTRIES; i++) {
+        total->calls[i] += stats->calls[i];
+        total->bytes[i] += stats->bytes[i];
+    }
+    for (i = 0; i < STATS_SIZE_BUCKETS; i++)
+        total->sizes[i] += stats->sizes[i];
+    for (i = 0; i < STATS_KERNELS; i++)
+        total->kernels[i] += stats->kernels[i];
+    total->gil_released_ns += stats->gil_released_ns;
+}
+
+// Fold an exiting thread's counts into stats_retired and free its block.
+#ifdef _WIN32
+static VOID WINAPI
+#else
+static void
+#endif
+_stats_retire(void* block)
+{
+    HashxxStats *stats = (HashxxStats*)block, **link;
+
+    PyThread_acquire_lock(stats_lock, WAIT_LOCK);
+    for (link = &stats_all; *link != NULL; link = &(*link)->next) {
+        if (*link == stats) {
+            *link = stats->next;
+            break;
+        }
+    }
+    _stats_add(&stats_retired, stats);
+    PyThread_release_lock(stats_lock);
+    if (stats_local == stats)
+        stats_local = NULL;
+    free(stats);
+}
+
+// Called with stats_lock held. Returns -1 if the block can't be
+// retired, in which case it is not kept.
+static int
+_stats_register(HashxxStats* stats)
+{
+#ifdef _WIN32
+    if (stats_key == FLS_OUT_OF_INDEXES &&
+        (stats_key = FlsAlloc(_stats_retire)) == FLS_OUT_OF_INDEXES)
+        return -1;
+    if (! FlsSetValue(stats_key, stats))
+        return -1;
+#else
+    if (! stats_key_created) {
+        if (pthread_key_create(&stats_key, _stats_retire) != 0)
+            return -1;
+        stats_key_created = 1;
+    }
+    if (pthread_setspecific(stats_key, stats) != 0)
+        return -1;
+#endif
+    stats->next = stats_all;
+    stats_all = stats;
+    return 0;
+}
+
+static HashxxStats*
+_stats_get_local(void)
+{
+    HashxxStats* stats = stats_local;
+    int registered;
+
+    if (stats != NULL)
+        return stats;
+
+    // Out of memory only costs us this thread's statistics
+    stats = (HashxxStats*)calloc(1, sizeof(HashxxStats));
+    if (stats == NULL)
+        return NULL;
+    PyThread_acquire_lock(stats_lock, WAIT_LOCK);
+    registered = _stats_register(stats);
+    PyThread_release_lock(stats_lock);
+    if (registered < 0) {
+        free(stats);
+        return NULL;
+    }
+    stats_local = stats;
+    return stats;
+}
+
+static void
+_stats_call(int entry, Py_ssize_t nbytes)
+{
+    HashxxStats* stats = _stats_get_local();
+    int bucket = 0;
+    size_t n = (size_t)nbytes;
+
+    if (stats == NULL)
+        return;
+    while (n && bucket < STATS_SIZE_BUCKETS - 1) {
+        bucket++;
+        n >>= 1;
+    }
+    stats->calls[entry]++;
+    stats->bytes[entry] += nbytes;
+    stats->sizes[bucket]++;
+}
+
+static void
+_stats_kernel(int kernel)
+{
+    HashxxStats* stats = _stats_get_local();
+    if (stats != NULL)
+        stats->kernels[kernel]++;
+}
+
+static unsigned long long
+_stats_now_ns(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER now, freq;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return (unsigned long long)(now.QuadPart / (double)freq.QuadPart * 1e9);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+static void
+_stats_gil_released(unsigned long long start_ns)
+{
+    HashxxStats* stats = _stats_get_local();
+    if (stats != NULL)
+        stats->gil_released_ns += _stats_now_ns() - start_ns;
+}
+
+#define STATS_CALL(entry, nbytes) \
+    do { if (stats_enabled) _stats_call(entry, nbytes); } while (0)
+#define STATS_KERNEL(kernel) \
+    do { if (stats_enabled) _stats_kernel(kernel); } while (0)
+
+// Replacements for Py_BEGIN/END_ALLOW_THREADS that also account the
+// time spent with the GIL released.
+#define HASHXX_BEGIN_ALLOW_THREADS \
+    { \
+        int _stats_timed = stats_enabled; \
+        unsigned long long _stats_start = _stats_timed ? _stats_now_ns() : 0; \
+        Py_BEGIN_ALLOW_THREADS
+#define HASHXX_END_ALLOW_THREADS \
+        Py_END_ALLOW_THREADS \
+        if (_stats_timed) _stats_gil_released(_stats_start); \
+    }
+
+#else
+
+#define STATS_CALL(entry, nbytes)
+#define STATS_KERNEL(kernel)
+#define HASHXX_BEGIN_ALLOW_THREADS Py_BEGIN_ALLOW_THREADS
+#define HASHXX_END_ALLOW_THREADS Py_END_ALLOW_THREADS
+
+#endif
+
+
+#if PY_MAJOR_VERSION >= 3
+#define _check_array_buffer PyObject_CheckBuffer
+#define _get_array_buffer PyObject_GetBuffer
+#else
+// On Python 2, array.array and mmap only implement the old buffer
+// protocol, so describe their storage in a Py_buffer ourselves.
+static int
+_check_array_buffer(PyObject* obj)
+{
+    return PyObject_CheckBuffer(obj) || PyObject_CheckReadBuffer(obj);
+}
+
+static int
+_get_array_buffer(PyObject* obj, Py_buffer* view, int flags)
+{
+    PyObject *itemsize, *typecode;
+    void* buf;
+    Py_ssize_t len;
+    int readonly = !(flags & PyBUF_WRITABLE);
+
+    if (PyObject_CheckBuffer(obj))
+        return PyObject_GetBuffer(obj, view, flags);
+
+    if (readonly ? PyObject_AsReadBuffer(obj, (const void**)&buf, &len)
+                 : PyObject_AsWriteBuffer(obj, &buf, &len))
+        return -1;
+    if (PyBuffer_FillInfo(view, obj, buf, len, readonly, PyBUF_SIMPLE) < 0)
+        return -1;
+
+    itemsize = PyObject_GetAttrString(obj, "itemsize");
+    typecode = PyObject_GetAttrString(obj, "typecode");
+    PyErr_Clear();
+    if (itemsize != NULL && PyInt_Check(itemsize))
+        view->itemsize = PyInt_AsSsize_t(itemsize);
+    if (typecode != NULL && PyString_Check(typecode)) {
+        const char* code = PyString_AS_STRING(typecode);
+        view->format = code[0] == 'I' ? "I" : code[0] == 'L' ? "L" : "B";
+    }
+    Py_XDECREF(itemsize);
+    Py_XDECREF(typecode);
+    return 0;
+}
+#endif
+
+
+// Get a read-only, contiguous view of a bytes-like object. Unicode is
+// rejected with the same error _update_hash gives, since its bytes
+// would depend on the encoding.
+static int
+_get_input_buffer(PyObject* obj, Py_buffer* view)
+{
+    if (PyUnicode_Check(obj)) {
+        PyErr_SetString(PyExc_TypeError, "Found unicode string, you must convert to bytes/str before hashing.");
+        return -1;
+    }
+    return _get_array_buffer(obj, view, PyBUF_SIMPLE);
+}
+
+// PySequence_Fast() for sequences whose items are used borrowed. A list
+// is returned as is, and on free-threaded builds another thread could
+// resize it or drop its items meanwhile, so there it is copied into a
+// tuple that holds its own references.
+static PyObject*
+_sequence_fast(PyObject* obj, const char* message)
+{
+#ifdef Py_GIL_DISABLED
+    if (PyList_Check(obj))
+        return PyList_AsTuple(obj);
+#endif
+    return PySequence_Fast(obj, message);
+}
+
+// Mutable objects are internally synchronized so they can be shared
+// between threads: their state is only touched with the object's lock
+// held. With a GIL the GIL already serializes access, so the lock is
+// only allocated up front on free-threaded builds, or before the GIL
+// is released while working on the object.
+static void
+_object_lock(PyThread_type_lock lock)
+{
+    if (lock == NULL)
+        return;
+    if (! PyThread_acquire_lock(lock, NOWAIT_LOCK)) {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(lock, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+static void
+_object_unlock(PyThread_type_lock lock)
+{
+    if (lock != NULL)
+        PyThread_release_lock(lock);
+}
+
+static int
+_object_lock_init(PyThread_type_lock* lock, int always)
+{
+#ifndef Py_GIL_DISABLED
+    if (! always)
+        return 0;
+#endif
+    if (*lock == NULL) {
+        *lock = PyThread_allocate_lock();
+        if (*lock == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+    return 0;
+}
+
 typedef struct {
     PyObject_HEAD
     void* xxhash_state;
+    PyThread_type_lock lock;
 } HashxxObject;
 
 static void
 Hashxx_dealloc(HashxxObject* self)
 {
+    PyTypeObject* type = Py_TYPE(self);
+
     XXH32_destroy(self->xxhash_state);
-    Py_TYPE(self)->tp_free((PyObject*)self);
+    if (self->lock != NULL)
+        PyThread_free_lock(self->lock);
+    type->tp_free((PyObject*)self);
+#ifdef HAVE_MULTI_PHASE_INIT
+    // Instances of heap types own a reference to their type
+    Py_DECREF(type);
+#endif
 }
 
 static PyObject *
@@ -28,6 +428,11 @@ Hashxx_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
     self = (HashxxObject *)type->tp_alloc(type, 0);
     if (self != NULL) {
         self->xxhash_state = NULL;
+        self->lock = NULL;
+        if (_object_lock_init(&self->lock, 0) < 0) {
+            Py_DECREF(self);
+            return NULL;
+        }
     }
 
     return (PyObject *)self;
@@ -43,34 +448,85 @@ Hashxx_init(HashxxObject *self, PyObject *args, PyObject *kwds)
             &seed))
         return -1;
 
-    self->xxhash_state = XXH32_init(seed);
+    _object_lock(self->lock);
+    if (self->xxhash_state == NULL)
+        self->xxhash_state = XXH32_init(seed);
+    else
+        XXH32_resetState(self->xxhash_state, seed);
+    _object_unlock(self->lock);
 
+    if (self->xxhash_state == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
     return 0;
 }
 
 
-static PyObject* _update_hash(void* hash_state, PyObject* arg_obj) {
+// Keys cache their digest for one seed (see the Key type below). Key
+// can't be subclassed, so its instances are recognised by their
+// deallocator, which is the same for the static type and for every
+// interpreter's heap type.
+typedef struct {
+    PyObject_VAR_HEAD
+    unsigned int digest;
+    unsigned int seed;
+    char data[1];
+} KeyObject;
+
+static void Key_dealloc(KeyObject* self);
+
+#define Key_Check(obj) (Py_TYPE(obj)->tp_dealloc == (destructor)Key_dealloc)
+
+// Hash the key in view, reusing the digest of a Key with the same seed.
+static unsigned int
+_buffer_digest(const Py_buffer* view, unsigned int seed)
+{
+    if (view->obj != NULL && Key_Check(view->obj) && ((KeyObject*)view->obj)->seed == seed)
+        return ((KeyObject*)view->obj)->digest;
+    return XXH32(view->buf, (int)view->len, seed);
+}
+
+
+// Feed arg_obj (bytes, bytearray, Key, None or a tuple of those) into the
+// hash state, adding the number of bytes hashed to *nbytes.
+static PyObject* _update_hash(void* hash_state, PyObject* arg_obj, Py_ssize_t* nbytes) {
     Py_ssize_t tuple_length;
     Py_ssize_t tuple_i;
     PyObject* tuple_obj, *partial_result;
+    const char* data = NULL;
+    Py_ssize_t data_len = 0;
+    Py_buffer view;
 
 #if PY_MAJOR_VERSION >= 3
     if (PyBytes_Check(arg_obj)) {
-        XXH32_update(hash_state, PyBytes_AsString(arg_obj), PyBytes_Size(arg_obj));
+        data = PyBytes_AsString(arg_obj);
+        data_len = PyBytes_Size(arg_obj);
     }
 #else
     if (PyString_Check(arg_obj)) {
-        XXH32_update(hash_state, PyString_AsString(arg_obj), PyString_Size(arg_obj));
+        data = PyString_AsString(arg_obj);
+        data_len = PyString_Size(arg_obj);
     }
 #endif
+    else if (Key_Check(arg_obj)) {
+        data = ((KeyObject*)arg_obj)->data;
+        data_len = Py_SIZE(arg_obj);
+    }
     else if (PyByteArray_Check(arg_obj)) {
-        XXH32_update(hash_state, PyByteArray_AsString(arg_obj), PyByteArray_Size(arg_obj));
+        // Holding a buffer export keeps other threads from resizing it
+        if (PyObject_GetBuffer(arg_obj, &view, PyBUF_SIMPLE) < 0)
+            return NULL;
+        XXH32_update(hash_state, view.buf, view.len);
+        STATS_KERNEL(STATS_KERNEL_XXH32_UPDATE);
+        *nbytes += view.len;
+        PyBuffer_Release(&view);
     }
     else if (PyTuple_Check(arg_obj)) {
         tuple_length = PyTuple_GET_SIZE(arg_obj);
         for(tuple_i = 0; tuple_i < tuple_length; tuple_i++) {
             tuple_obj = PyTuple_GetItem(arg_obj, tuple_i);
-            partial_result = _update_hash(hash_state, tuple_obj);
+            partial_result = _update_hash(hash_state, tuple_obj, nbytes);
             // Check exceptions
             if (partial_result == NULL) return NULL;
         }
@@ -87,14 +543,33 @@ static PyObject* _update_hash(void* hash_state, PyObject* arg_obj) {
         return NULL;
     }
 
+    if (data != NULL) {
+        XXH32_update(hash_state, data, data_len);
+        STATS_KERNEL(STATS_KERNEL_XXH32_UPDATE);
+        *nbytes += data_len;
+    }
+
     Py_RETURN_NONE;
 }
 
+// Hashxx.__new__() without __init__() leaves no state to hash into.
+// Called with the object locked, as the state only appears in __init__.
+static int
+_check_state(HashxxObject* self)
+{
+    if (self->xxhash_state == NULL) {
+        PyErr_SetString(PyExc_ValueError, "Hashxx object is not initialized.");
+        return -1;
+    }
+    return 0;
+}
+
 static PyObject *
 Hashxx_update(HashxxObject* self, PyObject *args)
 {
     Py_ssize_t arg_length = PyTuple_GET_SIZE(args);
     Py_ssize_t arg_i;
+    Py_ssize_t nbytes = 0;
     PyObject* arg_obj, *partial_result;
 
     if (arg_length == 0) {
@@ -102,110 +577,471 @@ Hashxx_update(HashxxObject* self, PyObject *args)
         return NULL;
     }
 
+    _object_lock(self->lock);
+    if (_check_state(self) < 0) {
+        _object_unlock(self->lock);
+        return NULL;
+    }
     for(arg_i = 0; arg_i < arg_length; arg_i++) {
         arg_obj = PyTuple_GetItem(args, arg_i);
-        partial_result = _update_hash(self->xxhash_state, arg_obj);
+        partial_result = _update_hash(self->xxhash_state, arg_obj, &nbytes);
         // Check exceptions
-        if (partial_result == NULL) return NULL;
+        if (partial_result == NULL) {
+            _object_unlock(self->lock);
+            return NULL;
+        }
     }
+    _object_unlock(self->lock);
 
+    STATS_CALL(STATS_HASHXX_UPDATE, nbytes);
     Py_RETURN_NONE;
 }
 
 
-static PyObject *
-Hashxx_digest(HashxxObject* self)
+// Streaming input
+//
+// _update_stream() feeds a file-like object or an iterable into a hash
+// state. Objects with readinto() are read into a single reused buffer;
+// otherwise read() or iteration supplies the chunks. Each chunk is
+// hashed with the owning Hashxx locked (if any) and, when it's large
+// enough to be worth it, with the GIL released.
+
+#define HASHXX_STREAM_BUFSIZE (64 * 1024)
+
+// XXH32_update() takes an int length, so feed huge chunks in pieces
+static void
+_update_large(void* state, const char* data, Py_ssize_t len)
 {
-    unsigned int digest = XXH32_digest(self->xxhash_state);
-    return Py_BuildValue("I", digest);
+    while (len > INT_MAX) {
+        XXH32_update(state, data, 1 << 30);
+        data += 1 << 30;
+        len -= 1 << 30;
+    }
+    XXH32_update(state, data, (int)len);
 }
 
-static PyMethodDef Hashxx_methods[] = {
-    {"update", (PyCFunction)Hashxx_update, METH_VARARGS,
-     "Update the digest with new data."
-    },
-    {"digest", (PyCFunction)Hashxx_digest, METH_NOARGS,
-     "Return the current digest value of the data processed so far."
-    },
-    {NULL}  /* Sentinel */
-};
+static void
+_update_chunk(HashxxObject* owner, void* state, const char* data, Py_ssize_t len)
+{
+    if (owner != NULL)
+        _object_lock(owner->lock);
+    if (len >= HASHXX_GIL_MINSIZE) {
+        HASHXX_BEGIN_ALLOW_THREADS
+        _update_large(state, data, len);
+        HASHXX_END_ALLOW_THREADS
+    }
+    else {
+        _update_large(state, data, len);
+    }
+    if (owner != NULL)
+        _object_unlock(owner->lock);
+    STATS_KERNEL(STATS_KERNEL_XXH32_UPDATE);
+}
 
+static int
+_update_stream(HashxxObject* owner, void* state, PyObject* src, Py_ssize_t bufsize, Py_ssize_t* nbytes)
+{
+    Py_buffer input;
+    PyObject *iter, *item;
 
+    if (owner != NULL && _object_lock_init(&owner->lock, 1) < 0)
+        return -1;
 
-static PyTypeObject pyhashxx_HashxxType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "pyhashxx.Hashxx",         /*tp_name*/
-    sizeof(HashxxObject), /*tp_basicsize*/
-    0,                         /*tp_itemsize*/
-    (destructor)Hashxx_dealloc,  /*tp_dealloc*/
-    0,                         /*tp_print*/
-    0,                         /*tp_getattr*/
-    0,                         /*tp_setattr*/
-    0,                         /*tp_compare*/
-    0,                         /*tp_repr*/
-    0,                         /*tp_as_number*/
-    0,                         /*tp_as_sequence*/
-    0,                         /*tp_as_mapping*/
-    0,                         /*tp_hash */
-    0,                         /*tp_call*/
-    0,                         /*tp_str*/
-    0,                         /*tp_getattro*/
-    0,                         /*tp_setattro*/
-    0,                         /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
-    "Hashxx objects",           /* tp_doc */
-    0,               /* tp_traverse */
-    0,               /* tp_clear */
-    0,               /* tp_richcompare */
-    0,               /* tp_weaklistoffset */
-    0,               /* tp_iter */
-    0,               /* tp_iternext */
-    Hashxx_methods,             /* tp_methods */
-    0,             /* tp_members */
-    0,                         /* tp_getset */
-    0,                         /* tp_base */
-    0,                         /* tp_dict */
-    0,                         /* tp_descr_get */
-    0,                         /* tp_descr_set */
-    0,                         /* tp_dictoffset */
-    (initproc)Hashxx_init,      /* tp_init */
-    0,                         /* tp_alloc */
-    Hashxx_new,                 /* tp_new */
-};
+    // A bytes-like object is a stream with a single chunk
+    if (PyObject_CheckBuffer(src) && ! PyUnicode_Check(src)) {
+        if (_get_input_buffer(src, &input) < 0)
+            return -1;
+        _update_chunk(owner, state, (const char*)input.buf, input.len);
+        *nbytes += input.len;
+        PyBuffer_Release(&input);
+        return 0;
+    }
 
+    if (PyObject_HasAttrString(src, "readinto")) {
+        PyObject *buffer, *view, *readinto, *result;
+        Py_ssize_t n;
+        int ret = -1;
 
+        buffer = PyByteArray_FromStringAndSize(NULL, bufsize);
+        if (buffer == NULL)
+            return -1;
+        view = PyMemoryView_FromObject(buffer);
+        readinto = PyObject_GetAttrString(src, "readinto");
+        if (view == NULL || readinto == NULL)
+            goto readinto_done;
 
-static PyObject *
-pyhashxx_hashxx(PyObject* self, PyObject *args, PyObject *kwds)
-{
-    unsigned int seed = 0;
-    const char* err_msg = NULL;
-    PyObject* err_obj = NULL;
-    Py_ssize_t args_len = 0;
-    unsigned int digest = 0;
-    void* state = NULL;
+        for (;;) {
+            result = PyObject_CallFunctionObjArgs(readinto, view, NULL);
+            if (result == NULL)
+                goto readinto_done;
+            if (result == Py_None) {
+                Py_DECREF(result);
+                PyErr_SetString(PyExc_ValueError, "readinto() returned None, non-blocking streams are not supported.");
+                goto readinto_done;
+            }
+            n = PyNumber_AsSsize_t(result, PyExc_OverflowError);
+            Py_DECREF(result);
+            if (n == -1 && PyErr_Occurred())
+                goto readinto_done;
+            if (n <= 0)
+                break;
+            if (n > bufsize)
+                n = bufsize;
+            _update_chunk(owner, state, PyByteArray_AS_STRING(buffer), n);
+            *nbytes += n;
+        }
+        ret = 0;
 
-    if (kwds != NULL) {
-        Py_ssize_t kwds_size = PyDict_Size(kwds);
-        PyObject* seed_obj = PyDict_GetItemString(kwds, "seed");
+    readinto_done:
+        Py_XDECREF(readinto);
+        Py_XDECREF(view);
+        Py_DECREF(buffer);
+        return ret;
+    }
 
-        if (kwds_size > 1) {
-            err_msg = "Unexpected keyword arguments, only 'seed' is supported.";
-            goto badarg;
-        }
+    if (PyObject_HasAttrString(src, "read")) {
+        PyObject *read = PyObject_GetAttrString(src, "read");
+        int ret = -1;
 
-        if (kwds_size == 1) {
-            if (seed_obj == NULL) {
-                err_msg = "Unexpected keyword argument, only 'seed' is supported.";
-                goto badarg;
+        if (read == NULL)
+            return -1;
+        for (;;) {
+            item = PyObject_CallFunction(read, "n", bufsize);
+            if (item == NULL)
+                break;
+            if (_get_input_buffer(item, &input) < 0) {
+                Py_DECREF(item);
+                break;
+            }
+            if (input.len == 0) {
+                ret = 0;
             }
-#if PY_MAJOR_VERSION < 3
-            if (PyInt_Check(seed_obj))
-                seed = PyInt_AsLong(seed_obj);
-            else
-#endif
-                if (PyLong_Check(seed_obj))
-                seed = PyLong_AsLong(seed_obj);
+            else {
+                _update_chunk(owner, state, (const char*)input.buf, input.len);
+                *nbytes += input.len;
+            }
+            PyBuffer_Release(&input);
+            Py_DECREF(item);
+            if (ret == 0)
+                break;
+        }
+        Py_DECREF(read);
+        return ret;
+    }
+
+    iter = PyObject_GetIter(src);
+    if (iter == NULL) {
+        PyErr_Format(PyExc_TypeError, "Expected a file-like or iterable object, not %.200s.", Py_TYPE(src)->tp_name);
+        return -1;
+    }
+    while ((item = PyIter_Next(iter)) != NULL) {
+        int ok = 1;
+
+        if (PyObject_CheckBuffer(item) && ! PyUnicode_Check(item)) {
+            if (_get_input_buffer(item, &input) < 0) {
+                ok = 0;
+            }
+            else {
+                _update_chunk(owner, state, (const char*)input.buf, input.len);
+                *nbytes += input.len;
+                PyBuffer_Release(&input);
+            }
+        }
+        else {
+            // Tuples, None and errors for everything else
+            if (owner != NULL)
+                _object_lock(owner->lock);
+            ok = _update_hash(state, item, nbytes) != NULL;
+            if (owner != NULL)
+                _object_unlock(owner->lock);
+        }
+        Py_DECREF(item);
+        if (! ok) {
+            Py_DECREF(iter);
+            return -1;
+        }
+    }
+    Py_DECREF(iter);
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+static PyObject *
+Hashxx_update_from(HashxxObject* self, PyObject *args, PyObject *kwds)
+{
+    PyObject* src;
+    Py_ssize_t bufsize = HASHXX_STREAM_BUFSIZE;
+    Py_ssize_t nbytes = 0;
+    static char *kwlist[] = {"iterable_or_readable", "bufsize", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O|n", kwlist,
+            &src, &bufsize))
+        return NULL;
+    if (bufsize < 1) {
+        PyErr_SetString(PyExc_ValueError, "bufsize must be at least 1.");
+        return NULL;
+    }
+
+    _object_lock(self->lock);
+    if (_check_state(self) < 0) {
+        _object_unlock(self->lock);
+        return NULL;
+    }
+    _object_unlock(self->lock);
+
+    if (_update_stream(self, self->xxhash_state, src, bufsize, &nbytes) < 0)
+        return NULL;
+    STATS_CALL(STATS_HASHXX_UPDATE_FROM, nbytes);
+    return PyLong_FromSsize_t(nbytes);
+}
+
+
+static PyObject *
+Hashxx_digest(HashxxObject* self)
+{
+    unsigned int digest;
+
+    _object_lock(self->lock);
+    if (_check_state(self) < 0) {
+        _object_unlock(self->lock);
+        return NULL;
+    }
+    digest = XXH32_digest(self->xxhash_state);
+    _object_unlock(self->lock);
+    STATS_CALL(STATS_HASHXX_DIGEST, 0);
+    STATS_KERNEL(STATS_KERNEL_XXH32_DIGEST);
+    return Py_BuildValue("I", digest);
+}
+
+
+// Exported states are the portable XXH32 state prefixed with a magic
+// number and a format version, bumped whenever the layout changes.
+#define HASHXX_STATE_MAGIC "hXX"
+#define HASHXX_STATE_VERSION 1
+#define HASHXX_STATE_HEADER_SIZE 4
+#define HASHXX_STATE_SIZE (HASHXX_STATE_HEADER_SIZE + XXH32_STATE_EXPORT_SIZE)
+
+static PyObject *
+Hashxx_export_state(HashxxObject* self)
+{
+    unsigned char data[HASHXX_STATE_SIZE];
+
+    memcpy(data, HASHXX_STATE_MAGIC, 3);
+    data[3] = HASHXX_STATE_VERSION;
+    _object_lock(self->lock);
+    if (_check_state(self) < 0) {
+        _object_unlock(self->lock);
+        return NULL;
+    }
+    XXH32_exportState(self->xxhash_state, data + HASHXX_STATE_HEADER_SIZE);
+    _object_unlock(self->lock);
+    return PyBytes_FromStringAndSize((const char*)data, HASHXX_STATE_SIZE);
+}
+
+static int
+_import_state(HashxxObject* self, PyObject *state_obj)
+{
+    Py_buffer state;
+    const unsigned char* data;
+
+    if (_get_input_buffer(state_obj, &state) < 0)
+        return -1;
+    data = (const unsigned char*)state.buf;
+
+    if (state.len < HASHXX_STATE_HEADER_SIZE || memcmp(data, HASHXX_STATE_MAGIC, 3) != 0) {
+        PyErr_SetString(PyExc_ValueError, "Not an exported Hashxx state.");
+        goto error;
+    }
+    if (data[3] != HASHXX_STATE_VERSION) {
+        PyErr_Format(PyExc_ValueError, "Unsupported Hashxx state version %d.", (int)data[3]);
+        goto error;
+    }
+    if (state.len != HASHXX_STATE_SIZE) {
+        PyErr_SetString(PyExc_ValueError, "Exported Hashxx state has the wrong length.");
+        goto error;
+    }
+
+    _object_lock(self->lock);
+    if (self->xxhash_state == NULL)
+        self->xxhash_state = XXH32_init(0);
+    if (self->xxhash_state == NULL) {
+        _object_unlock(self->lock);
+        PyErr_NoMemory();
+        goto error;
+    }
+    if (XXH32_importState(self->xxhash_state, data + HASHXX_STATE_HEADER_SIZE) != OK) {
+        _object_unlock(self->lock);
+        PyErr_SetString(PyExc_ValueError, "Exported Hashxx state is corrupt.");
+        goto error;
+    }
+    _object_unlock(self->lock);
+
+    PyBuffer_Release(&state);
+    return 0;
+
+error:
+    PyBuffer_Release(&state);
+    return -1;
+}
+
+static PyObject *
+Hashxx_setstate(HashxxObject* self, PyObject *state_obj)
+{
+    if (_import_state(self, state_obj) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+Hashxx_from_state(PyObject* cls, PyObject *state_obj)
+{
+    PyObject* result = PyObject_CallObject(cls, NULL);
+    if (result == NULL)
+        return NULL;
+    if (_import_state((HashxxObject*)result, state_obj) < 0) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    return result;
+}
+
+static PyObject *
+Hashxx_reduce(HashxxObject* self)
+{
+    PyObject* state = Hashxx_export_state(self);
+    if (state == NULL)
+        return NULL;
+    return Py_BuildValue("(O()N)", Py_TYPE(self), state);
+}
+
+static PyMethodDef Hashxx_methods[] = {
+    {"update", (PyCFunction)Hashxx_update, METH_VARARGS,
+     "Update the digest with new data."
+    },
+    {"update_from", (PyCFunction)Hashxx_update_from, METH_VARARGS | METH_KEYWORDS,
+     "update_from(iterable_or_readable, bufsize=65536)\n\n"
+     "Update the digest with all the data of a file-like object, read bufsize\n"
+     "bytes at a time, or with every chunk produced by an iterable. Returns the\n"
+     "number of bytes hashed."
+    },
+    {"digest", (PyCFunction)Hashxx_digest, METH_NOARGS,
+     "Return the current digest value of the data processed so far."
+    },
+    {"export_state", (PyCFunction)Hashxx_export_state, METH_NOARGS,
+     "Return the state of the calculation as bytes, to resume it later with\n"
+     "Hashxx.from_state(). The format is versioned and portable across machines."
+    },
+    {"from_state", (PyCFunction)Hashxx_from_state, METH_O | METH_CLASS,
+     "Create a Hashxx that resumes the calculation exported by export_state()."
+    },
+    {"__reduce__", (PyCFunction)Hashxx_reduce, METH_NOARGS,
+     "Support for pickling."
+    },
+    {"__setstate__", (PyCFunction)Hashxx_setstate, METH_O,
+     "Restore a state exported by export_state()."
+    },
+    {NULL}  /* Sentinel */
+};
+
+
+
+#ifdef HAVE_MULTI_PHASE_INIT
+
+static PyType_Slot Hashxx_slots[] = {
+    {Py_tp_dealloc, Hashxx_dealloc},
+    {Py_tp_doc, "Hashxx objects"},
+    {Py_tp_methods, Hashxx_methods},
+    {Py_tp_init, Hashxx_init},
+    {Py_tp_new, Hashxx_new},
+    {0, NULL}
+};
+
+static PyType_Spec Hashxx_spec = {
+    "pyhashxx.Hashxx",
+    sizeof(HashxxObject),
+    0,
+    Py_TPFLAGS_DEFAULT,
+    Hashxx_slots
+};
+
+#else
+
+static PyTypeObject pyhashxx_HashxxType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "pyhashxx.Hashxx",         /*tp_name*/
+    sizeof(HashxxObject), /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)Hashxx_dealloc,  /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "Hashxx objects",           /* tp_doc */
+    0,               /* tp_traverse */
+    0,               /* tp_clear */
+    0,               /* tp_richcompare */
+    0,               /* tp_weaklistoffset */
+    0,               /* tp_iter */
+    0,               /* tp_iternext */
+    Hashxx_methods,             /* tp_methods */
+    0,             /* tp_members */
+    0,                         /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    (initproc)Hashxx_init,      /* tp_init */
+    0,                         /* tp_alloc */
+    Hashxx_new,                 /* tp_new */
+};
+
+#endif
+
+
+
+static PyObject *
+pyhashxx_hashxx(PyObject* self, PyObject *args, PyObject *kwds)
+{
+    unsigned int seed = 0;
+    const char* err_msg = NULL;
+    PyObject* err_obj = NULL;
+    Py_ssize_t args_len = 0;
+    unsigned int digest = 0;
+    Py_ssize_t nbytes = 0;
+    void* state = NULL;
+
+    if (kwds != NULL) {
+        Py_ssize_t kwds_size = PyDict_Size(kwds);
+        PyObject* seed_obj = PyDict_GetItemString(kwds, "seed");
+
+        if (kwds_size > 1) {
+            err_msg = "Unexpected keyword arguments, only 'seed' is supported.";
+            goto badarg;
+        }
+
+        if (kwds_size == 1) {
+            if (seed_obj == NULL) {
+                err_msg = "Unexpected keyword argument, only 'seed' is supported.";
+                goto badarg;
+            }
+#if PY_MAJOR_VERSION < 3
+            if (PyInt_Check(seed_obj))
+                seed = PyInt_AsLong(seed_obj);
+            else
+#endif
+                if (PyLong_Check(seed_obj))
+                seed = PyLong_AsLong(seed_obj);
             else {
                 err_msg = "Unexpected seed value type: %S";
                 err_obj = seed_obj;
@@ -225,17 +1061,31 @@ pyhashxx_hashxx(PyObject* self, PyObject *args, PyObject *kwds)
     if (args_len == 1) {
         PyObject* hash_obj = PyTuple_GetItem(args, 0);
         int did_hash = 1;
+        Py_ssize_t hash_len = 0;
 #if PY_MAJOR_VERSION >= 3
         if (PyBytes_Check(hash_obj)) {
-            digest = XXH32(PyBytes_AsString(hash_obj), PyBytes_Size(hash_obj), seed);
+            hash_len = PyBytes_Size(hash_obj);
+            digest = XXH32(PyBytes_AsString(hash_obj), hash_len, seed);
         }
 #else
         if (PyString_Check(hash_obj)) {
-            digest = XXH32(PyString_AsString(hash_obj), PyString_Size(hash_obj), seed);
+            hash_len = PyString_Size(hash_obj);
+            digest = XXH32(PyString_AsString(hash_obj), hash_len, seed);
         }
 #endif
         else if (PyByteArray_Check(hash_obj)) {
-            digest = XXH32(PyByteArray_AsString(hash_obj), PyByteArray_Size(hash_obj), seed);
+            // Holding a buffer export keeps other threads from resizing it
+            Py_buffer view;
+            if (PyObject_GetBuffer(hash_obj, &view, PyBUF_SIMPLE) < 0)
+                return NULL;
+            hash_len = view.len;
+            digest = XXH32(view.buf, hash_len, seed);
+            PyBuffer_Release(&view);
+        }
+        else if (Key_Check(hash_obj)) {
+            KeyObject* key = (KeyObject*)hash_obj;
+            hash_len = Py_SIZE(key);
+            digest = key->seed == seed ? key->digest : XXH32(key->data, hash_len, seed);
         }
         else if (hash_obj == Py_None) {
             // Nothing to hash
@@ -245,18 +1095,23 @@ pyhashxx_hashxx(PyObject* self, PyObject *args, PyObject *kwds)
             did_hash = 0;
         }
 
-        if (did_hash)
+        if (did_hash) {
+            STATS_CALL(STATS_HASHXX_FAST, hash_len);
+            STATS_KERNEL(STATS_KERNEL_XXH32);
             return Py_BuildValue("I", digest);
+        }
     }
 
     // Otherwise, do it the long, slower way
     state = XXH32_init(seed);
-    if (_update_hash(state, args) == NULL) {
+    if (_update_hash(state, args, &nbytes) == NULL) {
         XXH32_destroy(state);
         return NULL;
     }
     digest = XXH32_digest(state);
     XXH32_destroy(state);
+    STATS_CALL(STATS_HASHXX_SLOW, nbytes);
+    STATS_KERNEL(STATS_KERNEL_XXH32_DIGEST);
 
     return Py_BuildValue("I", digest);
 
@@ -268,30 +1123,3392 @@ badseed:
     return NULL;
 }
 
-static PyMethodDef pyhashxx_methods[] = {
-    {"hashxx", (PyCFunction)pyhashxx_hashxx, METH_VARARGS | METH_KEYWORDS,
-     "Compute the xxHash value for the given value, optionally providing a seed."
-    },
-    {NULL}  /* Sentinel */
-};
 
+// Append item to list, consuming the reference to item.
+static int
+_list_append_new(PyObject* list, PyObject* item)
+{
+    int ret;
+    if (item == NULL)
+        return -1;
+    ret = PyList_Append(list, item);
+    Py_DECREF(item);
+    return ret;
+}
 
+static PyObject *
+pyhashxx_hash_stream(PyObject* self, PyObject *args, PyObject *kwds)
+{
+    PyObject* src;
+    Py_ssize_t bufsize = HASHXX_STREAM_BUFSIZE;
+    Py_ssize_t nbytes = 0;
+    unsigned int seed = 0, digest;
+    void* state;
+    static char *kwlist[] = {"iterable_or_readable", "seed", "bufsize", NULL};
 
-MOD_INIT(pyhashxx) {
-    PyObject* m;
-    MOD_DECL(m, "pyhashxx",
-        "Python wrapper of the xxHash fast hash algorithm.",
-        pyhashxx_methods);
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O|In", kwlist,
+            &src, &seed, &bufsize))
+        return NULL;
+    if (bufsize < 1) {
+        PyErr_SetString(PyExc_ValueError, "bufsize must be at least 1.");
+        return NULL;
+    }
 
-    if (PyType_Ready(&pyhashxx_HashxxType) < 0)
-        RETURN_MOD_INIT_ERROR;
+    state = XXH32_init(seed);
+    if (_update_stream(NULL, state, src, bufsize, &nbytes) < 0) {
+        XXH32_destroy(state);
+        return NULL;
+    }
+    digest = XXH32_digest(state);
+    XXH32_destroy(state);
+    STATS_CALL(STATS_HASH_STREAM, nbytes);
+    STATS_KERNEL(STATS_KERNEL_XXH32_DIGEST);
 
-    MOD_DEF(m);
-    if (m == NULL)
-        RETURN_MOD_INIT_ERROR;
+    return Py_BuildValue("I", digest);
+}
 
-    Py_INCREF(&pyhashxx_HashxxType);
-    PyModule_AddObject(m, "Hashxx", (PyObject *)&pyhashxx_HashxxType);
 
-    RETURN_MOD_INIT_SUCCESS(m);
+// Get a view of an array of unsigned 32-bit integers such as
+// array('I'), naming the offending argument if it is anything else.
+static int
+_get_uint32_array(PyObject* obj, Py_buffer* view, int flags, const char* name)
+{
+    if (_get_array_buffer(obj, view, flags | PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) < 0)
+        return -1;
+    if (view->itemsize != sizeof(unsigned int) ||
+        (view->format != NULL && strchr("IL", view->format[strlen(view->format) - 1]) == NULL)) {
+        PyErr_Format(PyExc_TypeError, "%s must be an array of unsigned 32-bit integers.", name);
+        PyBuffer_Release(view);
+        return -1;
+    }
+    return 0;
+}
+
+// Get a writable view of an unsigned 32-bit array with room for at
+// least count digests, for functions taking an out= parameter.
+static int
+_get_digest_buffer(PyObject* obj, Py_ssize_t count, Py_buffer* view)
+{
+    if (_get_uint32_array(obj, view, PyBUF_WRITABLE, "out") < 0)
+        return -1;
+    if (view->len / view->itemsize < count) {
+        PyErr_Format(PyExc_ValueError, "out is too small, %zd digests are needed.", count);
+        PyBuffer_Release(view);
+        return -1;
+    }
+    return 0;
+}
+
+// Allocate a zeroed array.array('I') of count digests and get a
+// writable view of its storage.
+static PyObject*
+_new_digest_array(Py_ssize_t count, Py_buffer* view)
+{
+    PyObject *array_mod, *one, *result;
+
+    array_mod = PyImport_ImportModule("array");
+    if (array_mod == NULL)
+        return NULL;
+    one = PyObject_CallMethod(array_mod, "array", "s[i]", "I", 0);
+    Py_DECREF(array_mod);
+    if (one == NULL)
+        return NULL;
+    result = PySequence_Repeat(one, count);
+    Py_DECREF(one);
+    if (result == NULL)
+        return NULL;
+    if (_get_digest_buffer(result, count, view) < 0) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    return result;
 }
+
+// Robust winnowing (Schleimer, Wilkerson & Aiken): from every run of
+// winnow consecutive digests select the minimum, preferring the
+// rightmost on ties, and emit it each time the selection changes.
+static PyObject*
+_winnow_digests(const unsigned int* digests, Py_ssize_t count, Py_ssize_t winnow, Py_ssize_t step)
+{
+    PyObject* result = PyList_New(0);
+    Py_ssize_t right, i, selected = -1;
+
+    if (result == NULL || count == 0)
+        return result;
+    if (winnow > count)
+        winnow = count;
+
+    for (right = winnow - 1; right < count; right++) {
+        Py_ssize_t left = right - winnow + 1;
+
+        if (selected < left) {
+            selected = right;
+            for (i = right - 1; i >= left; i--)
+                if (digests[i] < digests[selected])
+                    selected = i;
+        }
+        else if (digests[right] <= digests[selected]) {
+            selected = right;
+        }
+        else {
+            continue;
+        }
+
+        if (_list_append_new(result, Py_BuildValue("(nI)", selected * step, digests[selected])) < 0) {
+            Py_DECREF(result);
+            return NULL;
+        }
+    }
+
+    return result;
+}
+
+static PyObject *
+pyhashxx_hash_windows(PyObject* self, PyObject *args, PyObject *kwds)
+{
+    PyObject *buffer_obj, *out_obj = Py_None, *result = NULL;
+    Py_ssize_t window, step = 1, winnow = 0, count = 0;
+    unsigned int seed = 0;
+    unsigned int* digests;
+    Py_buffer input, output;
+    static char *kwlist[] = {"buffer", "window", "step", "seed", "out", "winnow", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "On|nIOn", kwlist,
+            &buffer_obj, &window, &step, &seed, &out_obj, &winnow))
+        return NULL;
+
+    if (window < 1 || window > INT_MAX) {
+        PyErr_SetString(PyExc_ValueError, "window must be between 1 and 2**31-1 bytes.");
+        return NULL;
+    }
+    if (step < 1) {
+        PyErr_SetString(PyExc_ValueError, "step must be at least 1.");
+        return NULL;
+    }
+    if (winnow < 0) {
+        PyErr_SetString(PyExc_ValueError, "winnow must not be negative.");
+        return NULL;
+    }
+    if (winnow > 0 && out_obj != Py_None) {
+        PyErr_SetString(PyExc_TypeError, "out cannot be combined with winnow.");
+        return NULL;
+    }
+
+    if (_get_input_buffer(buffer_obj, &input) < 0)
+        return NULL;
+    if (input.len >= window)
+        count = (input.len - window) / step + 1;
+
+    if (winnow > 0) {
+        digests = PyMem_New(unsigned int, count ? count : 1);
+        if (digests == NULL) {
+            PyErr_NoMemory();
+            goto done;
+        }
+    }
+    else if (out_obj != Py_None) {
+        if (_get_digest_buffer(out_obj, count, &output) < 0)
+            goto done;
+        digests = (unsigned int*)output.buf;
+        Py_INCREF(out_obj);
+        result = out_obj;
+    }
+    else {
+        result = _new_digest_array(count, &output);
+        if (result == NULL)
+            goto done;
+        digests = (unsigned int*)output.buf;
+    }
+
+    if (count > HASHXX_GIL_MINSIZE / window) {
+        HASHXX_BEGIN_ALLOW_THREADS
+        XXH32_windows(input.buf, count, step, (int)window, seed, digests);
+        HASHXX_END_ALLOW_THREADS
+    }
+    else {
+        XXH32_windows(input.buf, count, step, (int)window, seed, digests);
+    }
+    STATS_CALL(STATS_HASH_WINDOWS, input.len);
+    STATS_KERNEL(STATS_KERNEL_XXH32_WINDOWS);
+
+    if (winnow > 0) {
+        result = _winnow_digests(digests, count, winnow, step);
+        PyMem_Free(digests);
+    }
+    else {
+        PyBuffer_Release(&output);
+    }
+
+done:
+    PyBuffer_Release(&input);
+    return result;
+}
+
+
+// Parallel execution
+//
+// Work over items [0, n) is split into one contiguous range per thread.
+// The calling thread handles the first range itself and the rest run on
+// native threads that never touch Python objects, so the GIL stays
+// released throughout.
+
+typedef void (*hashxx_range_fn)(void* ctx, Py_ssize_t begin, Py_ssize_t end);
+
+typedef struct {
+    hashxx_range_fn fn;
+    void* ctx;
+    Py_ssize_t begin;
+    Py_ssize_t end;
+    PyThread_type_lock done;
+} HashxxTask;
+
+static void
+_run_task(void* arg)
+{
+    HashxxTask* task = (HashxxTask*)arg;
+    task->fn(task->ctx, task->begin, task->end);
+    PyThread_release_lock(task->done);
+}
+
+static int
+_run_parallel(hashxx_range_fn fn, void* ctx, Py_ssize_t n, int threads)
+{
+    HashxxTask* tasks;
+    int i, started = 0;
+
+    if (threads > n)
+        threads = (int)n;
+    if (threads <= 1) {
+        HASHXX_BEGIN_ALLOW_THREADS
+        fn(ctx, 0, n);
+        HASHXX_END_ALLOW_THREADS
+        return 0;
+    }
+
+    tasks = PyMem_New(HashxxTask, threads);
+    if (tasks == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i = 0; i < threads; i++) {
+        tasks[i].fn = fn;
+        tasks[i].ctx = ctx;
+        tasks[i].begin = n / threads * i + (i < n % threads ? i : n % threads);
+        tasks[i].end = tasks[i].begin + n / threads + (i < n % threads);
+        tasks[i].done = NULL;
+    }
+    for (i = 1; i < threads; i++) {
+        tasks[i].done = PyThread_allocate_lock();
+        if (tasks[i].done == NULL)
+            break;
+        PyThread_acquire_lock(tasks[i].done, WAIT_LOCK);
+    }
+
+    HASHXX_BEGIN_ALLOW_THREADS
+    for (i = 1; i < threads; i++) {
+        // If a thread can't be started, its range runs on this thread below
+        if (tasks[i].done == NULL ||
+            (long)PyThread_start_new_thread(_run_task, &tasks[i]) == -1)
+            break;
+        started = i;
+    }
+    fn(ctx, tasks[0].begin, tasks[0].end);
+    for (i = started + 1; i < threads; i++)
+        fn(ctx, tasks[i].begin, tasks[i].end);
+    for (i = 1; i <= started; i++)
+        PyThread_acquire_lock(tasks[i].done, WAIT_LOCK);
+    HASHXX_END_ALLOW_THREADS
+
+    for (i = 1; i < threads; i++)
+        if (tasks[i].done != NULL)
+            PyThread_free_lock(tasks[i].done);
+    PyMem_Free(tasks);
+    return 0;
+}
+
+
+// Read from a file-like object into buffer (a bytearray) until it is
+// full or the file ends, preferring readinto() to avoid copies. Returns
+// the number of bytes read, or -1 with an exception set.
+static Py_ssize_t
+_read_full(PyObject* file, PyObject* buffer)
+{
+    Py_ssize_t want = PyByteArray_GET_SIZE(buffer), got = 0;
+    PyObject *view = NULL, *chunk;
+    int has_readinto = PyObject_HasAttrString(file, "readinto");
+
+    if (has_readinto) {
+        view = PyMemoryView_FromObject(buffer);
+        if (view == NULL)
+            return -1;
+    }
+
+    while (got < want) {
+        Py_ssize_t n;
+
+        if (has_readinto) {
+            PyObject* slice = PySequence_GetSlice(view, got, want);
+            PyObject* result;
+            if (slice == NULL)
+                goto error;
+            result = PyObject_CallMethod(file, "readinto", "O", slice);
+            Py_DECREF(slice);
+            if (result == NULL)
+                goto error;
+            if (result == Py_None) {
+                Py_DECREF(result);
+                PyErr_SetString(PyExc_ValueError, "readinto() returned None, non-blocking streams are not supported.");
+                goto error;
+            }
+            n = PyNumber_AsSsize_t(result, PyExc_OverflowError);
+            Py_DECREF(result);
+            if (n == -1 && PyErr_Occurred())
+                goto error;
+            if (n > want - got)
+                n = want - got;
+        }
+        else {
+            Py_buffer data;
+            chunk = PyObject_CallMethod(file, "read", "n", want - got);
+            if (chunk == NULL)
+                goto error;
+            if (_get_input_buffer(chunk, &data) < 0) {
+                Py_DECREF(chunk);
+                goto error;
+            }
+            n = data.len;
+            if (n > want - got)
+                n = want - got;
+            memcpy(PyByteArray_AS_STRING(buffer) + got, data.buf, n);
+            PyBuffer_Release(&data);
+            Py_DECREF(chunk);
+        }
+
+        if (n <= 0)
+            break;
+        got += n;
+    }
+
+    Py_XDECREF(view);
+    return got;
+
+error:
+    Py_XDECREF(view);
+    return -1;
+}
+
+
+// Hash blocks of a buffer in parallel. The last block may be short.
+typedef struct {
+    const char* data;
+    Py_ssize_t len;
+    Py_ssize_t block_size;
+    unsigned int seed;
+    unsigned int* digests;
+} HashxxBlocks;
+
+static void
+_hash_block_range(void* ctx, Py_ssize_t begin, Py_ssize_t end)
+{
+    HashxxBlocks* blocks = (HashxxBlocks*)ctx;
+    Py_ssize_t i;
+
+    for (i = begin; i < end; i++) {
+        Py_ssize_t offset = i * blocks->block_size;
+        Py_ssize_t size = blocks->len - offset;
+        if (size > blocks->block_size)
+            size = blocks->block_size;
+        blocks->digests[i] = XXH32(blocks->data + offset, (int)size, blocks->seed);
+    }
+}
+
+static Py_ssize_t
+_count_blocks(Py_ssize_t len, Py_ssize_t block_size)
+{
+    return len / block_size + (len % block_size != 0);
+}
+
+// File-like inputs are read in batches of this many bytes per thread
+#define HASHXX_BLOCKS_BATCH_SIZE (8 * 1024 * 1024)
+
+// Compute the digest of every block of a bytes-like or file-like
+// object into a newly allocated array, which the caller must free with
+// PyMem_Free.
+static unsigned int*
+_hash_blocks(PyObject* obj, Py_ssize_t block_size, unsigned int seed, int threads,
+             Py_ssize_t* count_out, Py_ssize_t* nbytes_out)
+{
+    HashxxBlocks blocks;
+    Py_ssize_t count = 0, capacity, batch_blocks, batch_len;
+    unsigned int* digests = NULL;
+    PyObject* batch;
+
+    blocks.block_size = block_size;
+    blocks.seed = seed;
+
+    if (PyUnicode_Check(obj) || PyObject_CheckBuffer(obj)) {
+        Py_buffer input;
+
+        if (_get_input_buffer(obj, &input) < 0)
+            return NULL;
+        count = _count_blocks(input.len, block_size);
+        digests = PyMem_New(unsigned int, count ? count : 1);
+        if (digests == NULL) {
+            PyErr_NoMemory();
+            PyBuffer_Release(&input);
+            return NULL;
+        }
+        blocks.data = (const char*)input.buf;
+        blocks.len = input.len;
+        blocks.digests = digests;
+        if (_run_parallel(_hash_block_range, &blocks, count, threads) < 0) {
+            PyMem_Free(digests);
+            PyBuffer_Release(&input);
+            return NULL;
+        }
+        *count_out = count;
+        *nbytes_out = input.len;
+        PyBuffer_Release(&input);
+        return digests;
+    }
+
+    if (! PyObject_HasAttrString(obj, "readinto") && ! PyObject_HasAttrString(obj, "read")) {
+        PyErr_Format(PyExc_TypeError, "Expected a bytes-like or file-like object, not %.200s.", Py_TYPE(obj)->tp_name);
+        return NULL;
+    }
+
+    batch_blocks = HASHXX_BLOCKS_BATCH_SIZE / block_size;
+    if (batch_blocks < 1)
+        batch_blocks = 1;
+    batch_blocks *= threads;
+    batch = PyByteArray_FromStringAndSize(NULL, batch_blocks * block_size);
+    if (batch == NULL)
+        return NULL;
+
+    *nbytes_out = 0;
+    capacity = 0;
+    do {
+        batch_len = _read_full(obj, batch);
+        if (batch_len < 0)
+            goto error;
+        if (count + batch_blocks > capacity) {
+            unsigned int* grown;
+            capacity = capacity ? capacity * 2 : batch_blocks;
+            grown = PyMem_Resize(digests, unsigned int, capacity);
+            if (grown == NULL) {
+                PyErr_NoMemory();
+                goto error;
+            }
+            digests = grown;
+        }
+        blocks.data = PyByteArray_AS_STRING(batch);
+        blocks.len = batch_len;
+        blocks.digests = digests + count;
+        if (_run_parallel(_hash_block_range, &blocks, _count_blocks(batch_len, block_size), threads) < 0)
+            goto error;
+        count += _count_blocks(batch_len, block_size);
+        *nbytes_out += batch_len;
+    } while (batch_len == PyByteArray_GET_SIZE(batch));
+
+    Py_DECREF(batch);
+    *count_out = count;
+    return digests;
+
+error:
+    Py_DECREF(batch);
+    PyMem_Free(digests);
+    return NULL;
+}
+
+static int
+_check_block_args(Py_ssize_t block_size, int threads)
+{
+    if (block_size < 1 || block_size > INT_MAX) {
+        PyErr_SetString(PyExc_ValueError, "block_size must be between 1 and 2**31-1 bytes.");
+        return -1;
+    }
+    if (threads < 1) {
+        PyErr_SetString(PyExc_ValueError, "threads must be at least 1.");
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *
+pyhashxx_hash_blocks(PyObject* self, PyObject *args, PyObject *kwds)
+{
+    PyObject *obj, *out_obj = Py_None, *result;
+    Py_ssize_t block_size, count, nbytes;
+    unsigned int seed = 0;
+    int threads = 1;
+    unsigned int* digests;
+    Py_buffer output;
+    static char *kwlist[] = {"buffer_or_file", "block_size", "seed", "threads", "out", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "On|IiO", kwlist,
+            &obj, &block_size, &seed, &threads, &out_obj))
+        return NULL;
+    if (_check_block_args(block_size, threads) < 0)
+        return NULL;
+
+    digests = _hash_blocks(obj, block_size, seed, threads, &count, &nbytes);
+    if (digests == NULL)
+        return NULL;
+    STATS_CALL(STATS_HASH_BLOCKS, nbytes);
+    STATS_KERNEL(STATS_KERNEL_XXH32);
+
+    if (out_obj != Py_None) {
+        result = out_obj;
+        if (_get_digest_buffer(out_obj, count, &output) < 0)
+            result = NULL;
+        else
+            Py_INCREF(result);
+    }
+    else {
+        result = _new_digest_array(count, &output);
+    }
+    if (result != NULL) {
+        memcpy(output.buf, digests, count * sizeof(unsigned int));
+        PyBuffer_Release(&output);
+    }
+
+    PyMem_Free(digests);
+    return result;
+}
+
+static PyObject *
+pyhashxx_verify_blocks(PyObject* self, PyObject *args, PyObject *kwds)
+{
+    PyObject *obj, *expected_obj, *result = NULL;
+    PyObject *array_mod = NULL, *expected_array = NULL;
+    Py_ssize_t block_size, count, nbytes, expected_count, i;
+    unsigned int seed = 0;
+    int threads = 1;
+    unsigned int *digests, *expected;
+    Py_buffer expected_view;
+    static char *kwlist[] = {"buffer_or_file", "block_size", "expected", "seed", "threads", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "OnO|Ii", kwlist,
+            &obj, &block_size, &expected_obj, &seed, &threads))
+        return NULL;
+    if (_check_block_args(block_size, threads) < 0)
+        return NULL;
+
+    // Expected digests may be any sequence of ints; anything that isn't
+    // already a uint32 array is converted to one
+    if (! _check_array_buffer(expected_obj)) {
+        array_mod = PyImport_ImportModule("array");
+        if (array_mod == NULL)
+            return NULL;
+        expected_array = PyObject_CallMethod(array_mod, "array", "sO", "I", expected_obj);
+        Py_DECREF(array_mod);
+        if (expected_array == NULL)
+            return NULL;
+        expected_obj = expected_array;
+    }
+    if (_get_uint32_array(expected_obj, &expected_view, PyBUF_SIMPLE, "expected") < 0) {
+        Py_XDECREF(expected_array);
+        return NULL;
+    }
+    expected = (unsigned int*)expected_view.buf;
+    expected_count = expected_view.len / expected_view.itemsize;
+
+    digests = _hash_blocks(obj, block_size, seed, threads, &count, &nbytes);
+    if (digests == NULL)
+        goto done;
+    STATS_CALL(STATS_VERIFY_BLOCKS, nbytes);
+    STATS_KERNEL(STATS_KERNEL_XXH32);
+
+    // Missing and extra blocks count as mismatches too
+    result = PyList_New(0);
+    for (i = 0; result != NULL && i < (count > expected_count ? count : expected_count); i++) {
+        if (i < count && i < expected_count && digests[i] == expected[i])
+            continue;
+        if (_list_append_new(result, PyLong_FromSsize_t(i)) < 0)
+            Py_CLEAR(result);
+    }
+    PyMem_Free(digests);
+
+done:
+    PyBuffer_Release(&expected_view);
+    Py_XDECREF(expected_array);
+    return result;
+}
+
+
+// On-disk hash index
+//
+// build_index() writes a table mapping byte keys to unsigned 64-bit
+// values, which HashIndex reads in place from any buffer, typically an
+// mmap, without deserializing it. All integers are little-endian:
+//
+//   header (64 bytes)
+//     0   magic "PHXINDEX"
+//     8   u32 format version
+//     12  u32 algorithm (1 = XXH32)
+//     16  u32 seed
+//     20  u32 reserved, zero
+//     24  u64 number of entries
+//     32  u64 number of slots
+//     40  u64 offset of the slot table
+//     48  u64 offset of the key data
+//     56  u64 size of the key data
+//   slot table, one 24-byte slot per entry
+//     0   u32 digest of the key
+//     4   u32 key length, 0xFFFFFFFF for an empty slot
+//     8   u64 offset of the key in the key data
+//     16  u64 value
+//   key data, the keys back to back
+//
+// Slots are open addressed with linear probing. A key's first slot is
+// (digest * slots) >> 32, which spreads digests over any table size.
+
+#define HASHXX_INDEX_MAGIC "PHXINDEX"
+#define HASHXX_INDEX_VERSION 1
+#define HASHXX_INDEX_XXH32 1
+#define HASHXX_INDEX_HEADER_SIZE 64
+#define HASHXX_INDEX_SLOT_SIZE 24
+#define HASHXX_INDEX_EMPTY 0xFFFFFFFFU
+// Tables are sized for at most this many entries per 4 slots
+#define HASHXX_INDEX_LOAD 3
+
+#if defined(__GNUC__)
+#  define HASHXX_PREFETCH(p) __builtin_prefetch(p)
+#else
+#  define HASHXX_PREFETCH(p)
+#endif
+
+static void
+_write_le32(unsigned char* p, unsigned int v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static void
+_write_le64(unsigned char* p, unsigned long long v)
+{
+    _write_le32(p, (unsigned int)v);
+    _write_le32(p + 4, (unsigned int)(v >> 32));
+}
+
+static unsigned int
+_read_le32(const unsigned char* p)
+{
+    return (unsigned int)p[0] | ((unsigned int)p[1] << 8) |
+        ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static unsigned long long
+_read_le64(const unsigned char* p)
+{
+    return (unsigned long long)_read_le32(p) | ((unsigned long long)_read_le32(p + 4) << 32);
+}
+
+static unsigned long long
+_index_first_slot(unsigned int digest, unsigned long long nslots)
+{
+    return ((unsigned long long)digest * nslots) >> 32;
+}
+
+// Builder entries, before they are placed in slots
+typedef struct {
+    unsigned int digest;
+    unsigned int key_len;
+    unsigned long long key_offset;
+    unsigned long long value;
+} HashxxIndexEntry;
+
+// Write len bytes to a file-like object, in bounded chunks so huge
+// tables don't need a second in-memory copy.
+static int
+_write_all(PyObject* file, const char* data, Py_ssize_t len)
+{
+    while (len > 0) {
+        Py_ssize_t n = len < (1 << 20) ? len : (1 << 20);
+        PyObject* result = PyObject_CallMethod(file, "write", "N",
+            PyBytes_FromStringAndSize(data, n));
+        if (result == NULL)
+            return -1;
+        Py_DECREF(result);
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static PyObject *
+pyhashxx_build_index(PyObject* self, PyObject *args, PyObject *kwds)
+{
+    PyObject *file, *items, *iter = NULL, *item, *result = NULL;
+    unsigned int seed = 0;
+    HashxxIndexEntry* entries = NULL;
+    unsigned long long* slots = NULL;
+    char* keys = NULL;
+    Py_ssize_t nentries = 0, entries_capacity = 0, keys_len = 0, keys_capacity = 0, nbytes = 0;
+    unsigned long long nslots, i, j, used = 0;
+    unsigned char header[HASHXX_INDEX_HEADER_SIZE];
+    unsigned char* chunk = NULL;
+    static char *kwlist[] = {"file", "items", "seed", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "OO|I", kwlist,
+            &file, &items, &seed))
+        return NULL;
+
+    // Mappings contribute their items, anything else must yield pairs
+    if (PyDict_Check(items) || PyObject_HasAttrString(items, "items")) {
+        PyObject* pairs = PyObject_CallMethod(items, "items", NULL);
+        if (pairs == NULL)
+            return NULL;
+        iter = PyObject_GetIter(pairs);
+        Py_DECREF(pairs);
+    }
+    else {
+        iter = PyObject_GetIter(items);
+    }
+    if (iter == NULL)
+        return NULL;
+
+    while ((item = PyIter_Next(iter)) != NULL) {
+        PyObject *key_obj, *value_obj;
+        Py_buffer key;
+        unsigned long long value;
+
+        if (! PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2) {
+            PyErr_SetString(PyExc_TypeError, "Index items must be (key, value) pairs.");
+            Py_DECREF(item);
+            goto error;
+        }
+        key_obj = PyTuple_GET_ITEM(item, 0);
+        value_obj = PyNumber_Long(PyTuple_GET_ITEM(item, 1));
+        if (value_obj == NULL) {
+            Py_DECREF(item);
+            goto error;
+        }
+        value = PyLong_AsUnsignedLongLong(value_obj);
+        Py_DECREF(value_obj);
+        if (value == (unsigned long long)-1 && PyErr_Occurred()) {
+            Py_DECREF(item);
+            goto error;
+        }
+        if (_get_input_buffer(key_obj, &key) < 0) {
+            Py_DECREF(item);
+            goto error;
+        }
+        Py_DECREF(item);
+        if (key.len > INT_MAX) {
+            PyErr_SetString(PyExc_ValueError, "Index keys must be shorter than 2**31 bytes.");
+            PyBuffer_Release(&key);
+            goto error;
+        }
+
+        if (nentries == entries_capacity) {
+            HashxxIndexEntry* grown;
+            entries_capacity = entries_capacity ? entries_capacity * 2 : 1024;
+            grown = PyMem_Resize(entries, HashxxIndexEntry, entries_capacity);
+            if (grown == NULL) {
+                PyBuffer_Release(&key);
+                PyErr_NoMemory();
+                goto error;
+            }
+            entries = grown;
+        }
+        while (keys_len + key.len > keys_capacity) {
+            char* grown;
+            keys_capacity = keys_capacity ? keys_capacity * 2 : 64 * 1024;
+            grown = PyMem_Resize(keys, char, keys_capacity);
+            if (grown == NULL) {
+                PyBuffer_Release(&key);
+                PyErr_NoMemory();
+                goto error;
+            }
+            keys = grown;
+        }
+
+        entries[nentries].digest = _buffer_digest(&key, seed);
+        entries[nentries].key_len = (unsigned int)key.len;
+        entries[nentries].key_offset = keys_len;
+        entries[nentries].value = value;
+        memcpy(keys + keys_len, key.buf, key.len);
+        keys_len += key.len;
+        nbytes += key.len;
+        nentries++;
+        PyBuffer_Release(&key);
+    }
+    if (PyErr_Occurred())
+        goto error;
+
+    // The first-slot calculation only spreads 32-bit digests over
+    // tables of up to 2**32 slots
+    nslots = (unsigned long long)nentries * 4 / HASHXX_INDEX_LOAD + 1;
+    if (nslots > 0xFFFFFFFFULL) {
+        PyErr_SetString(PyExc_OverflowError, "Too many entries for one index.");
+        goto error;
+    }
+
+    // Place entries, with slots holding entry index + 1 so 0 is empty.
+    // Later duplicates of a key replace the earlier value.
+    slots = PyMem_New(unsigned long long, nslots);
+    if (slots == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    memset(slots, 0, nslots * sizeof(unsigned long long));
+    for (j = 0; j < (unsigned long long)nentries; j++) {
+        HashxxIndexEntry* entry = &entries[j];
+        i = _index_first_slot(entry->digest, nslots);
+        while (slots[i] != 0) {
+            HashxxIndexEntry* other = &entries[slots[i] - 1];
+            if (other->digest == entry->digest && other->key_len == entry->key_len &&
+                memcmp(keys + other->key_offset, keys + entry->key_offset, entry->key_len) == 0)
+                break;
+            if (++i == nslots)
+                i = 0;
+        }
+        if (slots[i] == 0)
+            used++;
+        slots[i] = j + 1;
+    }
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, HASHXX_INDEX_MAGIC, 8);
+    _write_le32(header + 8, HASHXX_INDEX_VERSION);
+    _write_le32(header + 12, HASHXX_INDEX_XXH32);
+    _write_le32(header + 16, seed);
+    _write_le64(header + 24, used);
+    _write_le64(header + 32, nslots);
+    _write_le64(header + 40, HASHXX_INDEX_HEADER_SIZE);
+    _write_le64(header + 48, HASHXX_INDEX_HEADER_SIZE + nslots * HASHXX_INDEX_SLOT_SIZE);
+    _write_le64(header + 56, keys_len);
+    if (_write_all(file, (const char*)header, sizeof(header)) < 0)
+        goto error;
+
+    chunk = PyMem_New(unsigned char, 4096 * HASHXX_INDEX_SLOT_SIZE);
+    if (chunk == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    for (i = 0; i < nslots; i += 4096) {
+        unsigned long long end = i + 4096 < nslots ? i + 4096 : nslots;
+        for (j = i; j < end; j++) {
+            unsigned char* slot = chunk + (j - i) * HASHXX_INDEX_SLOT_SIZE;
+            if (slots[j] == 0) {
+                memset(slot, 0, HASHXX_INDEX_SLOT_SIZE);
+                _write_le32(slot + 4, HASHXX_INDEX_EMPTY);
+            }
+            else {
+                HashxxIndexEntry* entry = &entries[slots[j] - 1];
+                _write_le32(slot, entry->digest);
+                _write_le32(slot + 4, entry->key_len);
+                _write_le64(slot + 8, entry->key_offset);
+                _write_le64(slot + 16, entry->value);
+            }
+        }
+        if (_write_all(file, (const char*)chunk, (end - i) * HASHXX_INDEX_SLOT_SIZE) < 0)
+            goto error;
+    }
+    if (_write_all(file, keys, keys_len) < 0)
+        goto error;
+
+    STATS_CALL(STATS_BUILD_INDEX, nbytes);
+    result = PyLong_FromUnsignedLongLong(used);
+
+error:
+    Py_XDECREF(iter);
+    PyMem_Free(entries);
+    PyMem_Free(keys);
+    PyMem_Free(slots);
+    PyMem_Free(chunk);
+    return result;
+}
+
+
+typedef struct {
+    PyObject_HEAD
+    Py_buffer view;
+    int open;
+    unsigned int seed;
+    unsigned long long nentries;
+    unsigned long long nslots;
+    const unsigned char* slots;
+    const char* keys;
+    unsigned long long keys_size;
+    PyThread_type_lock lock;
+} HashIndexObject;
+
+static void
+HashIndex_dealloc(HashIndexObject* self)
+{
+    PyTypeObject* type = Py_TYPE(self);
+
+    if (self->open)
+        PyBuffer_Release(&self->view);
+    if (self->lock != NULL)
+        PyThread_free_lock(self->lock);
+    type->tp_free((PyObject*)self);
+#ifdef HAVE_MULTI_PHASE_INIT
+    Py_DECREF(type);
+#endif
+}
+
+static PyObject *
+HashIndex_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    HashIndexObject *self;
+    PyObject* buffer_obj;
+    const unsigned char* data;
+    unsigned long long slots_offset, keys_offset, len;
+    static char *kwlist[] = {"buffer", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist,
+            &buffer_obj))
+        return NULL;
+
+    self = (HashIndexObject *)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+    self->open = 0;
+    self->lock = NULL;
+    if (_object_lock_init(&self->lock, 0) < 0)
+        goto error;
+    if (_get_input_buffer(buffer_obj, &self->view) < 0)
+        goto error;
+    self->open = 1;
+
+    data = (const unsigned char*)self->view.buf;
+    len = (unsigned long long)self->view.len;
+    if (len < HASHXX_INDEX_HEADER_SIZE || memcmp(data, HASHXX_INDEX_MAGIC, 8) != 0) {
+        PyErr_SetString(PyExc_ValueError, "Not a pyhashxx index.");
+        goto error;
+    }
+    if (_read_le32(data + 8) != HASHXX_INDEX_VERSION) {
+        PyErr_Format(PyExc_ValueError, "Unsupported index version %u.", _read_le32(data + 8));
+        goto error;
+    }
+    if (_read_le32(data + 12) != HASHXX_INDEX_XXH32) {
+        PyErr_Format(PyExc_ValueError, "Unsupported index algorithm %u.", _read_le32(data + 12));
+        goto error;
+    }
+    self->seed = _read_le32(data + 16);
+    self->nentries = _read_le64(data + 24);
+    self->nslots = _read_le64(data + 32);
+    slots_offset = _read_le64(data + 40);
+    keys_offset = _read_le64(data + 48);
+    self->keys_size = _read_le64(data + 56);
+    if (self->nslots == 0 || self->nslots > 0xFFFFFFFFULL || self->nentries > self->nslots ||
+        slots_offset > len || (len - slots_offset) / HASHXX_INDEX_SLOT_SIZE < self->nslots ||
+        keys_offset > len || len - keys_offset < self->keys_size) {
+        PyErr_SetString(PyExc_ValueError, "Index is truncated or corrupt.");
+        goto error;
+    }
+    self->slots = data + slots_offset;
+    self->keys = (const char*)data + keys_offset;
+
+    return (PyObject *)self;
+
+error:
+    Py_DECREF(self);
+    return NULL;
+}
+
+// Look up a key given its digest. Returns 1 and sets *value if found, 0
+// if not, or -1 with an exception set if the index is corrupt.
+static int
+_index_lookup(HashIndexObject* self, const char* key, Py_ssize_t len, unsigned int digest,
+              unsigned long long* value)
+{
+    unsigned long long i = _index_first_slot(digest, self->nslots), probes;
+
+    for (probes = 0; probes < self->nslots; probes++) {
+        const unsigned char* slot = self->slots + i * HASHXX_INDEX_SLOT_SIZE;
+        unsigned int key_len = _read_le32(slot + 4);
+
+        if (key_len == HASHXX_INDEX_EMPTY)
+            return 0;
+        if (_read_le32(slot) == digest && key_len == (unsigned long long)len) {
+            unsigned long long offset = _read_le64(slot + 8);
+            if (offset > self->keys_size || key_len > self->keys_size - offset) {
+                PyErr_SetString(PyExc_ValueError, "Index is truncated or corrupt.");
+                return -1;
+            }
+            if (memcmp(self->keys + offset, key, len) == 0) {
+                *value = _read_le64(slot + 16);
+                return 1;
+            }
+        }
+        if (++i == self->nslots)
+            i = 0;
+    }
+    return 0;
+}
+
+static int
+_index_check_open(HashIndexObject* self)
+{
+    if (! self->open) {
+        PyErr_SetString(PyExc_ValueError, "Operation on a closed HashIndex.");
+        return -1;
+    }
+    return 0;
+}
+
+// Look up one key object, returning the found flag as for _index_lookup
+static int
+_index_get(HashIndexObject* self, PyObject* key_obj, unsigned long long* value)
+{
+    Py_buffer key;
+    int found;
+
+    if (_get_input_buffer(key_obj, &key) < 0)
+        return -1;
+    _object_lock(self->lock);
+    found = _index_check_open(self);
+    // Longer keys can't be in an index, nor be hashed by XXH32()
+    if (found == 0 && key.len <= INT_MAX)
+        found = _index_lookup(self, (const char*)key.buf, key.len,
+            _buffer_digest(&key, self->seed), value);
+    _object_unlock(self->lock);
+    STATS_CALL(STATS_INDEX_LOOKUP, key.len);
+    STATS_KERNEL(STATS_KERNEL_XXH32);
+    PyBuffer_Release(&key);
+    return found;
+}
+
+static PyObject *
+HashIndex_get(HashIndexObject* self, PyObject *args)
+{
+    PyObject *key_obj, *default_obj = Py_None;
+    unsigned long long value;
+    int found;
+
+    if (! PyArg_ParseTuple(args, "O|O:get", &key_obj, &default_obj))
+        return NULL;
+    found = _index_get(self, key_obj, &value);
+    if (found < 0)
+        return NULL;
+    if (! found) {
+        Py_INCREF(default_obj);
+        return default_obj;
+    }
+    return PyLong_FromUnsignedLongLong(value);
+}
+
+static PyObject *
+HashIndex_subscript(HashIndexObject* self, PyObject *key_obj)
+{
+    unsigned long long value;
+    int found = _index_get(self, key_obj, &value);
+
+    if (found < 0)
+        return NULL;
+    if (! found) {
+        PyErr_SetObject(PyExc_KeyError, key_obj);
+        return NULL;
+    }
+    return PyLong_FromUnsignedLongLong(value);
+}
+
+static int
+HashIndex_contains(HashIndexObject* self, PyObject *key_obj)
+{
+    unsigned long long value;
+    return _index_get(self, key_obj, &value);
+}
+
+static Py_ssize_t
+HashIndex_length(HashIndexObject* self)
+{
+    return (Py_ssize_t)self->nentries;
+}
+
+// Batch lookups hash every key and prefetch its first slot before
+// probing any of them, so the cache misses of many keys overlap.
+#define HASHXX_INDEX_BATCH 64
+
+static PyObject *
+HashIndex_get_many(HashIndexObject* self, PyObject *args)
+{
+    PyObject *keys_obj, *default_obj = Py_None, *seq, *result = NULL;
+    Py_ssize_t n, start, i;
+    Py_buffer keys[HASHXX_INDEX_BATCH];
+    unsigned int digests[HASHXX_INDEX_BATCH];
+
+    if (! PyArg_ParseTuple(args, "O|O:get_many", &keys_obj, &default_obj))
+        return NULL;
+    seq = _sequence_fast(keys_obj, "get_many() expects an iterable of keys.");
+    if (seq == NULL)
+        return NULL;
+    n = PySequence_Fast_GET_SIZE(seq);
+    result = PyList_New(n);
+    if (result == NULL)
+        goto done;
+
+    for (start = 0; start < n; start += HASHXX_INDEX_BATCH) {
+        Py_ssize_t end = start + HASHXX_INDEX_BATCH < n ? start + HASHXX_INDEX_BATCH : n;
+        int error = 0;
+
+        for (i = start; i < end; i++) {
+            if (_get_input_buffer(PySequence_Fast_GET_ITEM(seq, i), &keys[i - start]) < 0) {
+                end = i;
+                error = 1;
+                break;
+            }
+        }
+
+        _object_lock(self->lock);
+        if (! error && _index_check_open(self) < 0)
+            error = 1;
+        if (! error) {
+            for (i = start; i < end; i++) {
+                Py_buffer* key = &keys[i - start];
+                digests[i - start] = key->len <= INT_MAX ? _buffer_digest(key, self->seed) : 0;
+                HASHXX_PREFETCH(self->slots + _index_first_slot(digests[i - start], self->nslots) * HASHXX_INDEX_SLOT_SIZE);
+            }
+            for (i = start; ! error && i < end; i++) {
+                Py_buffer* key = &keys[i - start];
+                unsigned long long value;
+                PyObject* item = default_obj;
+                int found = key->len <= INT_MAX ?
+                    _index_lookup(self, (const char*)key->buf, key->len, digests[i - start], &value) : 0;
+
+                // Counted per key, like get(), so both report the same way
+                STATS_CALL(STATS_INDEX_LOOKUP, key->len);
+                STATS_KERNEL(STATS_KERNEL_XXH32);
+                if (found < 0) {
+                    error = 1;
+                    break;
+                }
+                if (found) {
+                    item = PyLong_FromUnsignedLongLong(value);
+                    if (item == NULL) {
+                        error = 1;
+                        break;
+                    }
+                }
+                else {
+                    Py_INCREF(item);
+                }
+                PyList_SET_ITEM(result, i, item);
+            }
+        }
+        _object_unlock(self->lock);
+
+        for (i = start; i < end; i++)
+            PyBuffer_Release(&keys[i - start]);
+        if (error) {
+            Py_CLEAR(result);
+            break;
+        }
+    }
+
+done:
+    Py_DECREF(seq);
+    return result;
+}
+
+static PyObject *
+HashIndex_close(HashIndexObject* self)
+{
+    _object_lock(self->lock);
+    if (self->open) {
+        self->open = 0;
+        PyBuffer_Release(&self->view);
+    }
+    _object_unlock(self->lock);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+HashIndex_enter(HashIndexObject* self)
+{
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+static PyObject *
+HashIndex_exit(HashIndexObject* self, PyObject *args)
+{
+    return HashIndex_close(self);
+}
+
+static PyObject *
+HashIndex_get_seed(HashIndexObject* self, void* closure)
+{
+    return PyLong_FromUnsignedLong(self->seed);
+}
+
+static PyObject *
+HashIndex_get_algorithm(HashIndexObject* self, void* closure)
+{
+#if PY_MAJOR_VERSION >= 3
+    return PyUnicode_FromString("XXH32");
+#else
+    return PyString_FromString("XXH32");
+#endif
+}
+
+static PyMethodDef HashIndex_methods[] = {
+    {"get", (PyCFunction)HashIndex_get, METH_VARARGS,
+     "get(key, default=None)\n\n"
+     "Return the value stored for key, or default if it isn't in the index."
+    },
+    {"get_many", (PyCFunction)HashIndex_get_many, METH_VARARGS,
+     "get_many(keys, default=None)\n\n"
+     "Return a list with the value stored for each of keys, or default for\n"
+     "keys that aren't in the index."
+    },
+    {"close", (PyCFunction)HashIndex_close, METH_NOARGS,
+     "Release the underlying buffer, e.g. so that an mmap can be closed."
+    },
+    {"__enter__", (PyCFunction)HashIndex_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)HashIndex_exit, METH_VARARGS, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef HashIndex_getset[] = {
+    {"seed", (getter)HashIndex_get_seed, NULL, "Seed the keys were hashed with.", NULL},
+    {"algorithm", (getter)HashIndex_get_algorithm, NULL, "Hash algorithm of the index.", NULL},
+    {NULL}  /* Sentinel */
+};
+
+#define HashIndex_doc \
+    "HashIndex(buffer)\n\n" \
+    "Read-only view of an index written by build_index(), looked up in place.\n" \
+    "buffer is usually an mmap of the index file."
+
+#ifdef HAVE_MULTI_PHASE_INIT
+
+static PyType_Slot HashIndex_slots[] = {
+    {Py_tp_dealloc, HashIndex_dealloc},
+    {Py_tp_doc, HashIndex_doc},
+    {Py_tp_methods, HashIndex_methods},
+    {Py_tp_getset, HashIndex_getset},
+    {Py_tp_new, HashIndex_new},
+    {Py_mp_subscript, HashIndex_subscript},
+    {Py_mp_length, HashIndex_length},
+    {Py_sq_contains, HashIndex_contains},
+    {0, NULL}
+};
+
+static PyType_Spec HashIndex_spec = {
+    "pyhashxx.HashIndex",
+    sizeof(HashIndexObject),
+    0,
+    Py_TPFLAGS_DEFAULT,
+    HashIndex_slots
+};
+
+#else
+
+static PyMappingMethods HashIndex_as_mapping = {
+    (lenfunc)HashIndex_length,          /* mp_length */
+    (binaryfunc)HashIndex_subscript,    /* mp_subscript */
+    0,                                  /* mp_ass_subscript */
+};
+
+static PySequenceMethods HashIndex_as_sequence = {
+    0,                                  /* sq_length */
+    0,                                  /* sq_concat */
+    0,                                  /* sq_repeat */
+    0,                                  /* sq_item */
+    0,                                  /* sq_slice */
+    0,                                  /* sq_ass_item */
+    0,                                  /* sq_ass_slice */
+    (objobjproc)HashIndex_contains,     /* sq_contains */
+};
+
+static PyTypeObject pyhashxx_HashIndexType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "pyhashxx.HashIndex",      /*tp_name*/
+    sizeof(HashIndexObject),   /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)HashIndex_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    &HashIndex_as_sequence,    /*tp_as_sequence*/
+    &HashIndex_as_mapping,     /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    HashIndex_doc,             /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    HashIndex_methods,         /* tp_methods */
+    0,                         /* tp_members */
+    HashIndex_getset,          /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    HashIndex_new,             /* tp_new */
+};
+
+#endif
+
+
+// Count-min sketch
+//
+// Counters are a single depth x width block, one contiguous row after
+// another. A key is hashed twice and row r uses h1 + r * h2 (Kirsch &
+// Mitzenmacher), so every key costs two hashes whatever the depth.
+// The rows' addresses are independent, so their cache misses overlap;
+// a blocked layout with all of a key's counters in one cache line
+// measured slower (16 vs 11-13 ns per key at 128 MiB) and overcounted
+// several times more, because keys sharing a block collide in every row.
+// Conservative update only raises counters that are below the key's
+// new estimate, which reduces overestimation.
+
+#define HASHXX_SKETCH_SEED2(seed) ((seed) ^ 0x9E3779B9U)
+// Keys of fixed-width buffers are hashed this many at a time
+#define HASHXX_SKETCH_BATCH 256
+
+typedef struct {
+    Py_ssize_t width;
+    Py_ssize_t depth;
+    unsigned int seed;
+    int conservative;
+    unsigned long long total;
+    unsigned long long* counters;
+} HashxxSketch;
+
+static int
+_sketch_init(HashxxSketch* sketch, Py_ssize_t width, Py_ssize_t depth, unsigned int seed, int conservative)
+{
+    if (width < 1 || (unsigned long long)width > 0xFFFFFFFFULL) {
+        PyErr_SetString(PyExc_ValueError, "width must be between 1 and 2**32 - 1.");
+        return -1;
+    }
+    if (depth < 1 || depth > PY_SSIZE_T_MAX / width / (Py_ssize_t)sizeof(unsigned long long)) {
+        PyErr_SetString(PyExc_ValueError, "depth must be at least 1 and width * depth counters must fit in memory.");
+        return -1;
+    }
+    sketch->width = width;
+    sketch->depth = depth;
+    sketch->seed = seed;
+    sketch->conservative = conservative != 0;
+    sketch->total = 0;
+    sketch->counters = PyMem_New(unsigned long long, width * depth);
+    if (sketch->counters == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(sketch->counters, 0, width * depth * sizeof(unsigned long long));
+    return 0;
+}
+
+// Get a view of a key to count or look up. XXH32() takes an int
+// length, so longer keys would be hashed by a truncated length.
+static int
+_get_sketch_key(PyObject* obj, Py_buffer* view)
+{
+    if (_get_input_buffer(obj, view) < 0)
+        return -1;
+    if (view->len > INT_MAX) {
+        PyErr_SetString(PyExc_ValueError, "Sketch keys must be shorter than 2**31 bytes.");
+        PyBuffer_Release(view);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+_sketch_hash(HashxxSketch* sketch, const void* key, Py_ssize_t len, unsigned int* h1, unsigned int* h2)
+{
+    *h1 = XXH32(key, (int)len, sketch->seed);
+    *h2 = XXH32(key, (int)len, HASHXX_SKETCH_SEED2(sketch->seed));
+}
+
+static void
+_sketch_hash_buffer(HashxxSketch* sketch, const Py_buffer* key, unsigned int* h1, unsigned int* h2)
+{
+    *h1 = _buffer_digest(key, sketch->seed);
+    *h2 = XXH32(key->buf, (int)key->len, HASHXX_SKETCH_SEED2(sketch->seed));
+}
+
+#define SKETCH_COUNTER(sketch, row, r, h1, h2) \
+    ((row) + _index_first_slot((h1) + (unsigned int)(r) * (h2), (sketch)->width))
+
+// Count a key count more times and return its new estimate.
+static unsigned long long
+_sketch_add(HashxxSketch* sketch, unsigned int h1, unsigned int h2, unsigned long long count)
+{
+    unsigned long long* row;
+    unsigned long long estimate = (unsigned long long)-1;
+    Py_ssize_t r;
+
+    sketch->total += count;
+    if (sketch->conservative) {
+        for (r = 0, row = sketch->counters; r < sketch->depth; r++, row += sketch->width) {
+            unsigned long long* counter = SKETCH_COUNTER(sketch, row, r, h1, h2);
+            if (*counter < estimate)
+                estimate = *counter;
+        }
+        estimate += count;
+        for (r = 0, row = sketch->counters; r < sketch->depth; r++, row += sketch->width) {
+            unsigned long long* counter = SKETCH_COUNTER(sketch, row, r, h1, h2);
+            if (*counter < estimate)
+                *counter = estimate;
+        }
+    }
+    else {
+        for (r = 0, row = sketch->counters; r < sketch->depth; r++, row += sketch->width) {
+            unsigned long long* counter = SKETCH_COUNTER(sketch, row, r, h1, h2);
+            *counter += count;
+            if (*counter < estimate)
+                estimate = *counter;
+        }
+    }
+    return estimate;
+}
+
+static unsigned long long
+_sketch_estimate(HashxxSketch* sketch, unsigned int h1, unsigned int h2)
+{
+    unsigned long long* row;
+    unsigned long long estimate = (unsigned long long)-1;
+    Py_ssize_t r;
+
+    for (r = 0, row = sketch->counters; r < sketch->depth; r++, row += sketch->width) {
+        unsigned long long* counter = SKETCH_COUNTER(sketch, row, r, h1, h2);
+        if (*counter < estimate)
+            estimate = *counter;
+    }
+    return estimate;
+}
+
+// Hash n keys of key_size bytes into h1 and h2 with the window kernel,
+// n at most HASHXX_SKETCH_BATCH.
+static void
+_sketch_hash_fixed(HashxxSketch* sketch, const char* keys, Py_ssize_t n, Py_ssize_t key_size,
+                   unsigned int* h1, unsigned int* h2)
+{
+    XXH32_windows(keys, n, key_size, (int)key_size, sketch->seed, h1);
+    XXH32_windows(keys, n, key_size, (int)key_size, HASHXX_SKETCH_SEED2(sketch->seed), h2);
+}
+
+static void
+_sketch_add_fixed(HashxxSketch* sketch, const char* keys, Py_ssize_t n, Py_ssize_t key_size,
+                  unsigned long long count)
+{
+    unsigned int h1[HASHXX_SKETCH_BATCH], h2[HASHXX_SKETCH_BATCH];
+    Py_ssize_t start, i;
+
+    for (start = 0; start < n; start += HASHXX_SKETCH_BATCH) {
+        Py_ssize_t batch = n - start < HASHXX_SKETCH_BATCH ? n - start : HASHXX_SKETCH_BATCH;
+        _sketch_hash_fixed(sketch, keys + start * key_size, batch, key_size, h1, h2);
+        for (i = 0; i < batch; i++)
+            _sketch_add(sketch, h1[i], h2[i], count);
+    }
+}
+
+static int
+_sketch_check_merge(HashxxSketch* sketch, HashxxSketch* other)
+{
+    if (other->width != sketch->width || other->depth != sketch->depth || other->seed != sketch->seed) {
+        PyErr_SetString(PyExc_ValueError, "Can only merge sketches with the same width, depth and seed.");
+        return -1;
+    }
+    return 0;
+}
+
+// Add the counters of other into sketch. Summing conservative sketches
+// still never underestimates.
+static void
+_sketch_merge(HashxxSketch* sketch, HashxxSketch* other)
+{
+    Py_ssize_t i, n = sketch->width * sketch->depth;
+
+    for (i = 0; i < n; i++)
+        sketch->counters[i] += other->counters[i];
+    sketch->total += other->total;
+}
+
+// Counters are pickled as little-endian 64-bit integers, after the total.
+static PyObject *
+_sketch_getstate(HashxxSketch* sketch)
+{
+    Py_ssize_t i, n = sketch->width * sketch->depth;
+    PyObject* state = PyBytes_FromStringAndSize(NULL, (n + 1) * 8);
+    unsigned char* p;
+
+    if (state == NULL)
+        return NULL;
+    p = (unsigned char*)PyBytes_AS_STRING(state);
+    _write_le64(p, sketch->total);
+    for (i = 0; i < n; i++)
+        _write_le64(p + (i + 1) * 8, sketch->counters[i]);
+    return state;
+}
+
+static int
+_sketch_setstate(HashxxSketch* sketch, Py_buffer* state)
+{
+    Py_ssize_t i, n = sketch->width * sketch->depth;
+    const unsigned char* p = (const unsigned char*)state->buf;
+
+    if (state->len != (n + 1) * 8) {
+        PyErr_SetString(PyExc_ValueError, "Sketch state doesn't match the sketch dimensions.");
+        return -1;
+    }
+    sketch->total = _read_le64(p);
+    for (i = 0; i < n; i++)
+        sketch->counters[i] = _read_le64(p + (i + 1) * 8);
+    return 0;
+}
+
+static int
+_parse_count(PyObject* count_obj, unsigned long long* count)
+{
+    PY_LONG_LONG value;
+
+    if (count_obj == NULL) {
+        *count = 1;
+        return 0;
+    }
+    value = PyLong_AsLongLong(count_obj);
+    if (value == -1 && PyErr_Occurred())
+        return -1;
+    if (value < 0) {
+        PyErr_SetString(PyExc_ValueError, "count must not be negative.");
+        return -1;
+    }
+    *count = (unsigned long long)value;
+    return 0;
+}
+
+static int
+_parse_key_size(Py_ssize_t key_size)
+{
+    if (key_size < 0 || key_size > INT_MAX) {
+        PyErr_SetString(PyExc_ValueError, "key_size must be between 0 and 2**31 - 1.");
+        return -1;
+    }
+    return 0;
+}
+
+// Get the buffer of fixed-width keys passed to add_many().
+static int
+_get_fixed_keys(PyObject* keys_obj, Py_ssize_t key_size, Py_buffer* keys)
+{
+    if (_get_input_buffer(keys_obj, keys) < 0)
+        return -1;
+    if (keys->len % key_size != 0) {
+        PyErr_SetString(PyExc_ValueError, "Buffer length is not a multiple of key_size.");
+        PyBuffer_Release(keys);
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct {
+    PyObject_HEAD
+    HashxxSketch sketch;
+    PyThread_type_lock lock;
+} CountMinSketchObject;
+
+static void
+CountMinSketch_dealloc(CountMinSketchObject* self)
+{
+    PyTypeObject* type = Py_TYPE(self);
+
+    PyMem_Free(self->sketch.counters);
+    if (self->lock != NULL)
+        PyThread_free_lock(self->lock);
+    type->tp_free((PyObject*)self);
+#ifdef HAVE_MULTI_PHASE_INIT
+    Py_DECREF(type);
+#endif
+}
+
+static PyObject *
+CountMinSketch_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    CountMinSketchObject *self;
+    Py_ssize_t width, depth;
+    unsigned int seed = 0;
+    int conservative = 0;
+    static char *kwlist[] = {"width", "depth", "seed", "conservative", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "nn|Ii", kwlist,
+            &width, &depth, &seed, &conservative))
+        return NULL;
+
+    self = (CountMinSketchObject *)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+    if (_sketch_init(&self->sketch, width, depth, seed, conservative) < 0 ||
+        _object_lock_init(&self->lock, 0) < 0) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject *)self;
+}
+
+static PyObject *
+CountMinSketch_add(CountMinSketchObject* self, PyObject *args, PyObject *kwds)
+{
+    PyObject *key_obj, *count_obj = NULL;
+    unsigned long long count, estimate;
+    unsigned int h1, h2;
+    Py_buffer key;
+    static char *kwlist[] = {"key", "count", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kwlist,
+            &key_obj, &count_obj))
+        return NULL;
+    if (_parse_count(count_obj, &count) < 0 || _get_sketch_key(key_obj, &key) < 0)
+        return NULL;
+
+    _sketch_hash_buffer(&self->sketch, &key, &h1, &h2);
+    _object_lock(self->lock);
+    estimate = _sketch_add(&self->sketch, h1, h2, count);
+    _object_unlock(self->lock);
+    STATS_CALL(STATS_SKETCH_ADD, key.len);
+    STATS_KERNEL(STATS_KERNEL_XXH32);
+    PyBuffer_Release(&key);
+
+    return PyLong_FromUnsignedLongLong(estimate);
+}
+
+static PyObject *
+CountMinSketch_add_many(CountMinSketchObject* self, PyObject *args, PyObject *kwds)
+{
+    PyObject *keys_obj, *count_obj = NULL, *iter, *item;
+    Py_ssize_t key_size = 0, nbytes = 0;
+    unsigned long long count;
+    unsigned int h1, h2;
+    Py_buffer key;
+    static char *kwlist[] = {"keys", "count", "key_size", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O|On", kwlist,
+            &keys_obj, &count_obj, &key_size))
+        return NULL;
+    if (_parse_count(count_obj, &count) < 0 || _parse_key_size(key_size) < 0)
+        return NULL;
+
+    // Fixed-width keys are hashed in batches, without the GIL for large buffers
+    if (key_size > 0) {
+        if (_get_fixed_keys(keys_obj, key_size, &key) < 0)
+            return NULL;
+        if (key.len >= HASHXX_GIL_MINSIZE && _object_lock_init(&self->lock, 1) < 0) {
+            PyBuffer_Release(&key);
+            return NULL;
+        }
+        _object_lock(self->lock);
+        if (key.len >= HASHXX_GIL_MINSIZE) {
+            HASHXX_BEGIN_ALLOW_THREADS
+            _sketch_add_fixed(&self->sketch, (const char*)key.buf, key.len / key_size, key_size, count);
+            HASHXX_END_ALLOW_THREADS
+        }
+        else {
+            _sketch_add_fixed(&self->sketch, (const char*)key.buf, key.len / key_size, key_size, count);
+        }
+        _object_unlock(self->lock);
+        STATS_CALL(STATS_SKETCH_ADD, key.len);
+        STATS_KERNEL(STATS_KERNEL_XXH32_WINDOWS);
+        PyBuffer_Release(&key);
+        Py_RETURN_NONE;
+    }
+
+    iter = PyObject_GetIter(keys_obj);
+    if (iter == NULL)
+        return NULL;
+    while ((item = PyIter_Next(iter)) != NULL) {
+        if (_get_sketch_key(item, &key) < 0) {
+            Py_DECREF(item);
+            break;
+        }
+        _sketch_hash_buffer(&self->sketch, &key, &h1, &h2);
+        _object_lock(self->lock);
+        _sketch_add(&self->sketch, h1, h2, count);
+        _object_unlock(self->lock);
+        nbytes += key.len;
+        PyBuffer_Release(&key);
+        Py_DECREF(item);
+    }
+    Py_DECREF(iter);
+    STATS_CALL(STATS_SKETCH_ADD, nbytes);
+    STATS_KERNEL(STATS_KERNEL_XXH32);
+    if (PyErr_Occurred())
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+CountMinSketch_estimate(CountMinSketchObject* self, PyObject *key_obj)
+{
+    unsigned long long estimate;
+    unsigned int h1, h2;
+    Py_buffer key;
+
+    if (_get_sketch_key(key_obj, &key) < 0)
+        return NULL;
+    _sketch_hash_buffer(&self->sketch, &key, &h1, &h2);
+    PyBuffer_Release(&key);
+    _object_lock(self->lock);
+    estimate = _sketch_estimate(&self->sketch, h1, h2);
+    _object_unlock(self->lock);
+    return PyLong_FromUnsignedLongLong(estimate);
+}
+
+static PyObject *
+CountMinSketch_merge(CountMinSketchObject* self, PyObject *other_obj)
+{
+    CountMinSketchObject* other = (CountMinSketchObject*)other_obj;
+    HashxxSketch copy;
+
+    if (! PyObject_TypeCheck(other_obj, Py_TYPE(self))) {
+        PyErr_Format(PyExc_TypeError, "Can only merge with another %s.", Py_TYPE(self)->tp_name);
+        return NULL;
+    }
+    if (_sketch_check_merge(&self->sketch, &other->sketch) < 0)
+        return NULL;
+
+    // Snapshot other first so that only one lock is ever held
+    copy = other->sketch;
+    copy.counters = PyMem_New(unsigned long long, copy.width * copy.depth);
+    if (copy.counters == NULL)
+        return PyErr_NoMemory();
+    _object_lock(other->lock);
+    copy.total = other->sketch.total;
+    memcpy(copy.counters, other->sketch.counters, copy.width * copy.depth * sizeof(unsigned long long));
+    _object_unlock(other->lock);
+
+    _object_lock(self->lock);
+    _sketch_merge(&self->sketch, &copy);
+    _object_unlock(self->lock);
+    PyMem_Free(copy.counters);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+CountMinSketch_reduce(CountMinSketchObject* self)
+{
+    PyObject* state;
+
+    _object_lock(self->lock);
+    state = _sketch_getstate(&self->sketch);
+    _object_unlock(self->lock);
+    if (state == NULL)
+        return NULL;
+    return Py_BuildValue("(O(nnIi)N)", Py_TYPE(self), self->sketch.width, self->sketch.depth,
+                         self->sketch.seed, self->sketch.conservative, state);
+}
+
+static PyObject *
+CountMinSketch_setstate(CountMinSketchObject* self, PyObject *state_obj)
+{
+    Py_buffer state;
+    int ret;
+
+    if (_get_input_buffer(state_obj, &state) < 0)
+        return NULL;
+    _object_lock(self->lock);
+    ret = _sketch_setstate(&self->sketch, &state);
+    _object_unlock(self->lock);
+    PyBuffer_Release(&state);
+    if (ret < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+CountMinSketch_subscript(CountMinSketchObject* self, PyObject *key)
+{
+    return CountMinSketch_estimate(self, key);
+}
+
+static PyObject *
+_sketch_get(HashxxSketch* sketch, void* closure)
+{
+    switch ((int)(Py_intptr_t)closure) {
+    case 0:
+        return PyLong_FromUnsignedLongLong(sketch->total);
+    case 1:
+        return PyLong_FromSsize_t(sketch->width);
+    case 2:
+        return PyLong_FromSsize_t(sketch->depth);
+    case 3:
+        return PyLong_FromUnsignedLong(sketch->seed);
+    default:
+        return PyBool_FromLong(sketch->conservative);
+    }
+}
+
+static PyObject *
+CountMinSketch_get(CountMinSketchObject* self, void* closure)
+{
+    return _sketch_get(&self->sketch, closure);
+}
+
+#define SKETCH_GETSET(getter_fn) \
+    {"total", (getter)getter_fn, NULL, "Sum of all counts added.", (void*)0}, \
+    {"width", (getter)getter_fn, NULL, "Number of counters per row.", (void*)1}, \
+    {"depth", (getter)getter_fn, NULL, "Number of rows.", (void*)2}, \
+    {"seed", (getter)getter_fn, NULL, "Seed keys are hashed with.", (void*)3}, \
+    {"conservative", (getter)getter_fn, NULL, "Whether conservative update is used.", (void*)4}
+
+static PyMethodDef CountMinSketch_methods[] = {
+    {"add", (PyCFunction)CountMinSketch_add, METH_VARARGS | METH_KEYWORDS,
+     "add(key, count=1)\n\n"
+     "Count key count more times and return its new estimated count."
+    },
+    {"add_many", (PyCFunction)CountMinSketch_add_many, METH_VARARGS | METH_KEYWORDS,
+     "add_many(keys, count=1, key_size=0)\n\n"
+     "Count every key of an iterable count more times. With key_size, keys is\n"
+     "instead a bytes-like object holding keys of key_size bytes back to back."
+    },
+    {"estimate", (PyCFunction)CountMinSketch_estimate, METH_O,
+     "Return the estimated count of key, which is never less than its true count."
+    },
+    {"merge", (PyCFunction)CountMinSketch_merge, METH_O,
+     "Add in the counts of another sketch with the same width, depth and seed."
+    },
+    {"__reduce__", (PyCFunction)CountMinSketch_reduce, METH_NOARGS, NULL},
+    {"__setstate__", (PyCFunction)CountMinSketch_setstate, METH_O, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef CountMinSketch_getset[] = {
+    SKETCH_GETSET(CountMinSketch_get),
+    {NULL}  /* Sentinel */
+};
+
+#define CountMinSketch_doc \
+    "CountMinSketch(width, depth, seed=0, conservative=False)\n\n" \
+    "Count-min sketch of width * depth 64-bit counters, estimating how many\n" \
+    "times each byte key was added."
+
+
+// Top-k heavy hitters
+//
+// TopK keeps the k keys with the highest estimates in its own sketch,
+// in a min-heap ordered by estimate so that the weakest candidate is at
+// the root. An open-addressed table maps key digests to heap positions,
+// so most keys are checked without creating a Python object.
+
+typedef struct {
+    PyObject* key;              // bytes
+    unsigned int digest;
+    unsigned long long count;
+    Py_ssize_t slot;            // position in the table
+} TopKEntry;
+
+typedef struct {
+    PyObject_HEAD
+    HashxxSketch sketch;
+    Py_ssize_t k;
+    Py_ssize_t size;
+    TopKEntry* heap;
+    Py_ssize_t* table;          // heap positions, -1 when empty
+    Py_ssize_t table_mask;      // table size is a power of two, at least 2k
+    PyThread_type_lock lock;
+} TopKObject;
+
+static Py_ssize_t
+_topk_find(TopKObject* self, unsigned int digest, const char* key, Py_ssize_t len)
+{
+    Py_ssize_t slot = digest & self->table_mask;
+
+    while (self->table[slot] >= 0) {
+        TopKEntry* entry = &self->heap[self->table[slot]];
+        if (entry->digest == digest && PyBytes_GET_SIZE(entry->key) == len &&
+            memcmp(PyBytes_AS_STRING(entry->key), key, len) == 0)
+            return slot;
+        slot = (slot + 1) & self->table_mask;
+    }
+    return -1;
+}
+
+static void
+_topk_table_insert(TopKObject* self, Py_ssize_t pos)
+{
+    Py_ssize_t slot = self->heap[pos].digest & self->table_mask;
+
+    while (self->table[slot] >= 0)
+        slot = (slot + 1) & self->table_mask;
+    self->table[slot] = pos;
+    self->heap[pos].slot = slot;
+}
+
+// Empty a slot, moving later entries of its probe run back into the
+// hole so that lookups never stop short of them.
+static void
+_topk_table_remove(TopKObject* self, Py_ssize_t hole)
+{
+    Py_ssize_t slot = hole;
+
+    self->table[hole] = -1;
+    for (;;) {
+        TopKEntry* entry;
+        Py_ssize_t home;
+
+        slot = (slot + 1) & self->table_mask;
+        if (self->table[slot] < 0)
+            return;
+        entry = &self->heap[self->table[slot]];
+        home = entry->digest & self->table_mask;
+        // Leave the entry if its home lies cyclically in (hole, slot]
+        if (((slot - home) & self->table_mask) < ((slot - hole) & self->table_mask))
+            continue;
+        self->table[hole] = self->table[slot];
+        self->table[slot] = -1;
+        entry->slot = hole;
+        hole = slot;
+    }
+}
+
+static void
+_topk_swap(TopKObject* self, Py_ssize_t a, Py_ssize_t b)
+{
+    TopKEntry tmp = self->heap[a];
+    self->heap[a] = self->heap[b];
+    self->heap[b] = tmp;
+    self->table[self->heap[a].slot] = a;
+    self->table[self->heap[b].slot] = b;
+}
+
+static void
+_topk_sift_up(TopKObject* self, Py_ssize_t pos)
+{
+    while (pos > 0) {
+        Py_ssize_t parent = (pos - 1) / 2;
+        if (self->heap[parent].count <= self->heap[pos].count)
+            break;
+        _topk_swap(self, parent, pos);
+        pos = parent;
+    }
+}
+
+static void
+_topk_sift_down(TopKObject* self, Py_ssize_t pos)
+{
+    for (;;) {
+        Py_ssize_t child = 2 * pos + 1, smallest = pos;
+        if (child < self->size && self->heap[child].count < self->heap[smallest].count)
+            smallest = child;
+        if (child + 1 < self->size && self->heap[child + 1].count < self->heap[smallest].count)
+            smallest = child + 1;
+        if (smallest == pos)
+            break;
+        _topk_swap(self, pos, smallest);
+        pos = smallest;
+    }
+}
+
+// Offer a key with its current estimate. If key_obj is NULL or not
+// exactly bytes, a bytes copy is only made when the key gets tracked.
+static int
+_topk_offer(TopKObject* self, PyObject* key_obj, const char* key, Py_ssize_t len,
+            unsigned int digest, unsigned long long count)
+{
+    Py_ssize_t slot, pos;
+
+    if (self->size == self->k && count <= self->heap[0].count)
+        return 0;
+    slot = _topk_find(self, digest, key, len);
+    if (slot >= 0) {
+        // Estimates only grow, so a tracked key can only move down
+        pos = self->table[slot];
+        self->heap[pos].count = count;
+        _topk_sift_down(self, pos);
+        return 0;
+    }
+
+    if (key_obj != NULL && PyBytes_CheckExact(key_obj))
+        Py_INCREF(key_obj);
+    else if ((key_obj = PyBytes_FromStringAndSize(key, len)) == NULL)
+        return -1;
+
+    if (self->size == self->k) {
+        _topk_table_remove(self, self->heap[0].slot);
+        Py_DECREF(self->heap[0].key);
+        pos = 0;
+    }
+    else {
+        pos = self->size++;
+    }
+    self->heap[pos].key = key_obj;
+    self->heap[pos].digest = digest;
+    self->heap[pos].count = count;
+    _topk_table_insert(self, pos);
+    _topk_sift_up(self, pos);
+    _topk_sift_down(self, pos);
+    return 0;
+}
+
+// Colliding keys raise the estimates of tracked keys behind their
+// backs, so bring the counts up to date before reporting them.
+static void
+_topk_refresh(TopKObject* self)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < self->size; i++) {
+        PyObject* key = self->heap[i].key;
+        unsigned int h1, h2;
+
+        _sketch_hash(&self->sketch, PyBytes_AS_STRING(key), PyBytes_GET_SIZE(key), &h1, &h2);
+        self->heap[i].count = _sketch_estimate(&self->sketch, h1, h2);
+    }
+    for (i = self->size / 2 - 1; i >= 0; i--)
+        _topk_sift_down(self, i);
+}
+
+static void
+_topk_clear(TopKObject* self)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < self->size; i++)
+        Py_DECREF(self->heap[i].key);
+    for (i = 0; i <= self->table_mask; i++)
+        self->table[i] = -1;
+    self->size = 0;
+}
+
+static void
+TopK_dealloc(TopKObject* self)
+{
+    PyTypeObject* type = Py_TYPE(self);
+
+    if (self->table != NULL)
+        _topk_clear(self);
+    PyMem_Free(self->heap);
+    PyMem_Free(self->table);
+    PyMem_Free(self->sketch.counters);
+    if (self->lock != NULL)
+        PyThread_free_lock(self->lock);
+    type->tp_free((PyObject*)self);
+#ifdef HAVE_MULTI_PHASE_INIT
+    Py_DECREF(type);
+#endif
+}
+
+static PyObject *
+TopK_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    TopKObject *self;
+    Py_ssize_t k, width, depth, table_size, i;
+    unsigned int seed = 0;
+    int conservative = 1;
+    static char *kwlist[] = {"k", "width", "depth", "seed", "conservative", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "nnn|Ii", kwlist,
+            &k, &width, &depth, &seed, &conservative))
+        return NULL;
+    if (k < 1 || k > PY_SSIZE_T_MAX / 4 / (Py_ssize_t)sizeof(TopKEntry)) {
+        PyErr_SetString(PyExc_ValueError, "k must be at least 1 and small enough to fit in memory.");
+        return NULL;
+    }
+
+    self = (TopKObject *)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+    self->k = k;
+    self->size = 0;
+    for (table_size = 2; table_size < 2 * k; table_size *= 2)
+        ;
+    self->table_mask = table_size - 1;
+    self->heap = PyMem_New(TopKEntry, k);
+    self->table = PyMem_New(Py_ssize_t, table_size);
+    if (self->heap == NULL || self->table == NULL) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+    for (i = 0; i < table_size; i++)
+        self->table[i] = -1;
+    if (_sketch_init(&self->sketch, width, depth, seed, conservative) < 0 ||
+        _object_lock_init(&self->lock, 0) < 0) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject *)self;
+}
+
+static int
+_topk_add(TopKObject* self, PyObject* key_obj, const char* key, Py_ssize_t len,
+          unsigned int h1, unsigned int h2, unsigned long long count)
+{
+    unsigned long long estimate = _sketch_add(&self->sketch, h1, h2, count);
+    return _topk_offer(self, key_obj, key, len, h1, estimate);
+}
+
+static PyObject *
+TopK_add(TopKObject* self, PyObject *args, PyObject *kwds)
+{
+    PyObject *key_obj, *count_obj = NULL;
+    unsigned long long count;
+    unsigned int h1, h2;
+    Py_buffer key;
+    int ret;
+    static char *kwlist[] = {"key", "count", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kwlist,
+            &key_obj, &count_obj))
+        return NULL;
+    if (_parse_count(count_obj, &count) < 0 || _get_sketch_key(key_obj, &key) < 0)
+        return NULL;
+
+    _sketch_hash_buffer(&self->sketch, &key, &h1, &h2);
+    _object_lock(self->lock);
+    ret = _topk_add(self, key_obj, (const char*)key.buf, key.len, h1, h2, count);
+    _object_unlock(self->lock);
+    STATS_CALL(STATS_TOPK_ADD, key.len);
+    STATS_KERNEL(STATS_KERNEL_XXH32);
+    PyBuffer_Release(&key);
+
+    if (ret < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+TopK_add_many(TopKObject* self, PyObject *args, PyObject *kwds)
+{
+    PyObject *keys_obj, *count_obj = NULL, *iter, *item;
+    Py_ssize_t key_size = 0, nbytes = 0;
+    unsigned long long count;
+    unsigned int h1, h2;
+    Py_buffer key;
+    static char *kwlist[] = {"keys", "count", "key_size", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O|On", kwlist,
+            &keys_obj, &count_obj, &key_size))
+        return NULL;
+    if (_parse_count(count_obj, &count) < 0 || _parse_key_size(key_size) < 0)
+        return NULL;
+
+    // Tracked keys are bytes objects, so the GIL stays held here
+    if (key_size > 0) {
+        unsigned int h1s[HASHXX_SKETCH_BATCH], h2s[HASHXX_SKETCH_BATCH];
+        Py_ssize_t n, start, i;
+        const char* keys;
+        int ret = 0;
+
+        if (_get_fixed_keys(keys_obj, key_size, &key) < 0)
+            return NULL;
+        keys = (const char*)key.buf;
+        n = key.len / key_size;
+        _object_lock(self->lock);
+        for (start = 0; start < n && ret == 0; start += HASHXX_SKETCH_BATCH) {
+            Py_ssize_t batch = n - start < HASHXX_SKETCH_BATCH ? n - start : HASHXX_SKETCH_BATCH;
+            _sketch_hash_fixed(&self->sketch, keys + start * key_size, batch, key_size, h1s, h2s);
+            for (i = 0; i < batch && ret == 0; i++)
+                ret = _topk_add(self, NULL, keys + (start + i) * key_size, key_size, h1s[i], h2s[i], count);
+        }
+        _object_unlock(self->lock);
+        STATS_CALL(STATS_TOPK_ADD, key.len);
+        STATS_KERNEL(STATS_KERNEL_XXH32_WINDOWS);
+        PyBuffer_Release(&key);
+        if (ret < 0)
+            return NULL;
+        Py_RETURN_NONE;
+    }
+
+    iter = PyObject_GetIter(keys_obj);
+    if (iter == NULL)
+        return NULL;
+    while ((item = PyIter_Next(iter)) != NULL) {
+        int ret;
+
+        if (_get_sketch_key(item, &key) < 0) {
+            Py_DECREF(item);
+            break;
+        }
+        _sketch_hash_buffer(&self->sketch, &key, &h1, &h2);
+        _object_lock(self->lock);
+        ret = _topk_add(self, item, (const char*)key.buf, key.len, h1, h2, count);
+        _object_unlock(self->lock);
+        nbytes += key.len;
+        PyBuffer_Release(&key);
+        Py_DECREF(item);
+        if (ret < 0)
+            break;
+    }
+    Py_DECREF(iter);
+    STATS_CALL(STATS_TOPK_ADD, nbytes);
+    STATS_KERNEL(STATS_KERNEL_XXH32);
+    if (PyErr_Occurred())
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+TopK_estimate(TopKObject* self, PyObject *key_obj)
+{
+    unsigned long long estimate;
+    unsigned int h1, h2;
+    Py_buffer key;
+
+    if (_get_sketch_key(key_obj, &key) < 0)
+        return NULL;
+    _sketch_hash_buffer(&self->sketch, &key, &h1, &h2);
+    PyBuffer_Release(&key);
+    _object_lock(self->lock);
+    estimate = _sketch_estimate(&self->sketch, h1, h2);
+    _object_unlock(self->lock);
+    return PyLong_FromUnsignedLongLong(estimate);
+}
+
+// Snapshot the tracked keys as a list of (key, count) pairs.
+static PyObject *
+_topk_entries(TopKObject* self)
+{
+    PyObject* result;
+    Py_ssize_t i;
+
+    _object_lock(self->lock);
+    _topk_refresh(self);
+    result = PyList_New(self->size);
+    for (i = 0; result != NULL && i < self->size; i++) {
+        PyObject* item = Py_BuildValue("(OK)", self->heap[i].key, self->heap[i].count);
+        if (item == NULL) {
+            Py_CLEAR(result);
+            break;
+        }
+        PyList_SET_ITEM(result, i, item);
+    }
+    _object_unlock(self->lock);
+    return result;
+}
+
+static PyObject *
+TopK_merge(TopKObject* self, PyObject *other_obj)
+{
+    TopKObject* other = (TopKObject*)other_obj;
+    PyObject *candidates, *mine;
+    HashxxSketch copy;
+    Py_ssize_t i;
+    int ret = 0;
+
+    if (! PyObject_TypeCheck(other_obj, Py_TYPE(self))) {
+        PyErr_Format(PyExc_TypeError, "Can only merge with another %s.", Py_TYPE(self)->tp_name);
+        return NULL;
+    }
+    if (_sketch_check_merge(&self->sketch, &other->sketch) < 0)
+        return NULL;
+
+    // Snapshot other first so that only one lock is ever held
+    copy = other->sketch;
+    copy.counters = PyMem_New(unsigned long long, copy.width * copy.depth);
+    if (copy.counters == NULL)
+        return PyErr_NoMemory();
+    candidates = _topk_entries(other);
+    if (candidates == NULL) {
+        PyMem_Free(copy.counters);
+        return NULL;
+    }
+    _object_lock(other->lock);
+    copy.total = other->sketch.total;
+    memcpy(copy.counters, other->sketch.counters, copy.width * copy.depth * sizeof(unsigned long long));
+    _object_unlock(other->lock);
+
+    // Re-rank the keys tracked by either side against the merged sketch
+    _object_lock(self->lock);
+    mine = PyList_New(self->size);
+    if (mine == NULL) {
+        ret = -1;
+    }
+    else {
+        for (i = 0; i < self->size; i++) {
+            Py_INCREF(self->heap[i].key);
+            PyList_SET_ITEM(mine, i, self->heap[i].key);
+        }
+        _sketch_merge(&self->sketch, &copy);
+        _topk_clear(self);
+    }
+    for (i = 0; ret == 0 && i < PyList_GET_SIZE(mine) + PyList_GET_SIZE(candidates); i++) {
+        PyObject* key = i < PyList_GET_SIZE(mine) ? PyList_GET_ITEM(mine, i) :
+            PyTuple_GET_ITEM(PyList_GET_ITEM(candidates, i - PyList_GET_SIZE(mine)), 0);
+        unsigned int h1, h2;
+
+        _sketch_hash(&self->sketch, PyBytes_AS_STRING(key), PyBytes_GET_SIZE(key), &h1, &h2);
+        ret = _topk_offer(self, key, PyBytes_AS_STRING(key), PyBytes_GET_SIZE(key), h1,
+                          _sketch_estimate(&self->sketch, h1, h2));
+    }
+    _object_unlock(self->lock);
+
+    Py_XDECREF(mine);
+    Py_DECREF(candidates);
+    PyMem_Free(copy.counters);
+    if (ret < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static int
+_compare_counts_desc(const void* a, const void* b)
+{
+    unsigned long long x = ((const TopKEntry*)a)->count, y = ((const TopKEntry*)b)->count;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static PyObject *
+TopK_items(TopKObject* self)
+{
+    PyObject* result = NULL;
+    TopKEntry* entries;
+    Py_ssize_t i, n;
+
+    _object_lock(self->lock);
+    _topk_refresh(self);
+    n = self->size;
+    entries = PyMem_New(TopKEntry, n ? n : 1);
+    if (entries != NULL) {
+        memcpy(entries, self->heap, n * sizeof(TopKEntry));
+        for (i = 0; i < n; i++)
+            Py_INCREF(entries[i].key);
+    }
+    _object_unlock(self->lock);
+    if (entries == NULL)
+        return PyErr_NoMemory();
+
+    qsort(entries, n, sizeof(TopKEntry), _compare_counts_desc);
+    result = PyList_New(n);
+    for (i = 0; result != NULL && i < n; i++) {
+        PyObject* item = Py_BuildValue("(OK)", entries[i].key, entries[i].count);
+        if (item == NULL) {
+            Py_CLEAR(result);
+            break;
+        }
+        PyList_SET_ITEM(result, i, item);
+    }
+    for (i = 0; i < n; i++)
+        Py_DECREF(entries[i].key);
+    PyMem_Free(entries);
+    return result;
+}
+
+static PyObject *
+TopK_reduce(TopKObject* self)
+{
+    PyObject *sketch_state, *entries;
+
+    entries = _topk_entries(self);
+    if (entries == NULL)
+        return NULL;
+    _object_lock(self->lock);
+    sketch_state = _sketch_getstate(&self->sketch);
+    _object_unlock(self->lock);
+    if (sketch_state == NULL) {
+        Py_DECREF(entries);
+        return NULL;
+    }
+    return Py_BuildValue("(O(nnnIi)(NN))", Py_TYPE(self), self->k, self->sketch.width,
+                         self->sketch.depth, self->sketch.seed, self->sketch.conservative,
+                         sketch_state, entries);
+}
+
+static PyObject *
+TopK_setstate(TopKObject* self, PyObject *state_obj)
+{
+    PyObject *sketch_state, *entries, *seq;
+    Py_buffer state;
+    Py_ssize_t i;
+    int ret;
+
+    if (! PyArg_ParseTuple(state_obj, "OO:__setstate__", &sketch_state, &entries))
+        return NULL;
+    seq = _sequence_fast(entries, "TopK state entries must be a sequence.");
+    if (seq == NULL)
+        return NULL;
+    if (_get_input_buffer(sketch_state, &state) < 0) {
+        Py_DECREF(seq);
+        return NULL;
+    }
+
+    _object_lock(self->lock);
+    ret = _sketch_setstate(&self->sketch, &state);
+    if (ret == 0)
+        _topk_clear(self);
+    for (i = 0; ret == 0 && i < PySequence_Fast_GET_SIZE(seq); i++) {
+        PyObject* key;
+        unsigned long long count;
+
+        if (! PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i), "SK", &key, &count)) {
+            ret = -1;
+            break;
+        }
+        if (PyBytes_GET_SIZE(key) > INT_MAX) {
+            PyErr_SetString(PyExc_ValueError, "Sketch keys must be shorter than 2**31 bytes.");
+            ret = -1;
+            break;
+        }
+        ret = _topk_offer(self, key, PyBytes_AS_STRING(key), PyBytes_GET_SIZE(key),
+                          XXH32(PyBytes_AS_STRING(key), (int)PyBytes_GET_SIZE(key), self->sketch.seed),
+                          count);
+    }
+    _object_unlock(self->lock);
+
+    PyBuffer_Release(&state);
+    Py_DECREF(seq);
+    if (ret < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static Py_ssize_t
+TopK_length(TopKObject* self)
+{
+    return self->size;
+}
+
+static int
+TopK_contains(TopKObject* self, PyObject *key_obj)
+{
+    Py_buffer key;
+    Py_ssize_t slot;
+
+    if (_get_sketch_key(key_obj, &key) < 0)
+        return -1;
+    _object_lock(self->lock);
+    slot = _topk_find(self, _buffer_digest(&key, self->sketch.seed), (const char*)key.buf, key.len);
+    _object_unlock(self->lock);
+    PyBuffer_Release(&key);
+    return slot >= 0;
+}
+
+static PyObject *
+TopK_get(TopKObject* self, void* closure)
+{
+    return _sketch_get(&self->sketch, closure);
+}
+
+static PyObject *
+TopK_get_k(TopKObject* self, void* closure)
+{
+    return PyLong_FromSsize_t(self->k);
+}
+
+static PyMethodDef TopK_methods[] = {
+    {"add", (PyCFunction)TopK_add, METH_VARARGS | METH_KEYWORDS,
+     "add(key, count=1)\n\n"
+     "Count key count more times."
+    },
+    {"add_many", (PyCFunction)TopK_add_many, METH_VARARGS | METH_KEYWORDS,
+     "add_many(keys, count=1, key_size=0)\n\n"
+     "Count every key of an iterable count more times. With key_size, keys is\n"
+     "instead a bytes-like object holding keys of key_size bytes back to back."
+    },
+    {"estimate", (PyCFunction)TopK_estimate, METH_O,
+     "Return the estimated count of key, whether or not it is tracked."
+    },
+    {"items", (PyCFunction)TopK_items, METH_NOARGS,
+     "Return the tracked keys as a list of (key, estimate) pairs, highest first."
+    },
+    {"merge", (PyCFunction)TopK_merge, METH_O,
+     "Add in the counts of another TopK with the same width, depth and seed, and\n"
+     "re-rank the keys tracked by either."
+    },
+    {"__reduce__", (PyCFunction)TopK_reduce, METH_NOARGS, NULL},
+    {"__setstate__", (PyCFunction)TopK_setstate, METH_O, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef TopK_getset[] = {
+    {"k", (getter)TopK_get_k, NULL, "Maximum number of keys tracked.", NULL},
+    SKETCH_GETSET(TopK_get),
+    {NULL}  /* Sentinel */
+};
+
+#define TopK_doc \
+    "TopK(k, width, depth, seed=0, conservative=True)\n\n" \
+    "The k most frequent byte keys, by their estimates in a count-min sketch of\n" \
+    "width * depth counters."
+
+#ifdef HAVE_MULTI_PHASE_INIT
+
+static PyType_Slot CountMinSketch_slots[] = {
+    {Py_tp_dealloc, CountMinSketch_dealloc},
+    {Py_tp_doc, CountMinSketch_doc},
+    {Py_tp_methods, CountMinSketch_methods},
+    {Py_tp_getset, CountMinSketch_getset},
+    {Py_tp_new, CountMinSketch_new},
+    {Py_mp_subscript, CountMinSketch_subscript},
+    {0, NULL}
+};
+
+static PyType_Spec CountMinSketch_spec = {
+    "pyhashxx.CountMinSketch",
+    sizeof(CountMinSketchObject),
+    0,
+    Py_TPFLAGS_DEFAULT,
+    CountMinSketch_slots
+};
+
+static PyType_Slot TopK_slots[] = {
+    {Py_tp_dealloc, TopK_dealloc},
+    {Py_tp_doc, TopK_doc},
+    {Py_tp_methods, TopK_methods},
+    {Py_tp_getset, TopK_getset},
+    {Py_tp_new, TopK_new},
+    {Py_sq_length, TopK_length},
+    {Py_sq_contains, TopK_contains},
+    {0, NULL}
+};
+
+static PyType_Spec TopK_spec = {
+    "pyhashxx.TopK",
+    sizeof(TopKObject),
+    0,
+    Py_TPFLAGS_DEFAULT,
+    TopK_slots
+};
+
+#else
+
+static PyMappingMethods CountMinSketch_as_mapping = {
+    0,                                  /* mp_length */
+    (binaryfunc)CountMinSketch_subscript, /* mp_subscript */
+    0,                                  /* mp_ass_subscript */
+};
+
+static PyTypeObject pyhashxx_CountMinSketchType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "pyhashxx.CountMinSketch", /*tp_name*/
+    sizeof(CountMinSketchObject), /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)CountMinSketch_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    &CountMinSketch_as_mapping, /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    CountMinSketch_doc,        /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    CountMinSketch_methods,    /* tp_methods */
+    0,                         /* tp_members */
+    CountMinSketch_getset,     /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    CountMinSketch_new,        /* tp_new */
+};
+
+static PySequenceMethods TopK_as_sequence = {
+    (lenfunc)TopK_length,               /* sq_length */
+    0,                                  /* sq_concat */
+    0,                                  /* sq_repeat */
+    0,                                  /* sq_item */
+    0,                                  /* sq_slice */
+    0,                                  /* sq_ass_item */
+    0,                                  /* sq_ass_slice */
+    (objobjproc)TopK_contains,          /* sq_contains */
+};
+
+static PyTypeObject pyhashxx_TopKType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "pyhashxx.TopK",           /*tp_name*/
+    sizeof(TopKObject),        /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)TopK_dealloc,  /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    &TopK_as_sequence,         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    TopK_doc,                  /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    TopK_methods,              /* tp_methods */
+    0,                         /* tp_members */
+    TopK_getset,               /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    TopK_new,                  /* tp_new */
+};
+
+#endif
+
+
+// Keys
+//
+// A Key is an immutable byte string that hashes its contents once, at
+// construction, and uses the digest as its Python hash. Dict and set
+// lookups then cost a digest comparison instead of a SipHash pass, and
+// the same digest is reused by hashxx() and by the index and sketch
+// lookups when their seeds match.
+
+static PyObject *
+_key_new(PyTypeObject* type, const char* data, Py_ssize_t len, unsigned int digest, unsigned int seed)
+{
+    KeyObject* self = (KeyObject*)type->tp_alloc(type, len);
+
+    if (self == NULL)
+        return NULL;
+    memcpy(self->data, data, len);
+    self->data[len] = '\0';
+    self->digest = digest;
+    self->seed = seed;
+    return (PyObject*)self;
+}
+
+static void
+Key_dealloc(KeyObject* self)
+{
+    PyTypeObject* type = Py_TYPE(self);
+
+    type->tp_free((PyObject*)self);
+#ifdef HAVE_MULTI_PHASE_INIT
+    Py_DECREF(type);
+#endif
+}
+
+static PyObject *
+Key_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *data_obj, *result;
+    unsigned int seed = 0;
+    Py_buffer data;
+    static char *kwlist[] = {"data", "seed", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O|I", kwlist,
+            &data_obj, &seed))
+        return NULL;
+
+    // Keys are immutable, so an equivalent one can be shared
+    if (Py_TYPE(data_obj) == type && ((KeyObject*)data_obj)->seed == seed) {
+        Py_INCREF(data_obj);
+        return data_obj;
+    }
+    if (_get_input_buffer(data_obj, &data) < 0)
+        return NULL;
+    if (data.len > INT_MAX) {
+        PyErr_SetString(PyExc_ValueError, "Keys must be shorter than 2**31 bytes.");
+        PyBuffer_Release(&data);
+        return NULL;
+    }
+    result = _key_new(type, (const char*)data.buf, data.len, _buffer_digest(&data, seed), seed);
+    STATS_CALL(STATS_KEY, data.len);
+    STATS_KERNEL(STATS_KERNEL_XXH32);
+    PyBuffer_Release(&data);
+    return result;
+}
+
+static PyObject *
+Key_many(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *keys_obj, *result, *seq;
+    Py_ssize_t key_size = 0, nbytes = 0, n, i;
+    unsigned int seed = 0;
+    Py_buffer data;
+    static char *kwlist[] = {"keys", "seed", "key_size", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O|In", kwlist,
+            &keys_obj, &seed, &key_size))
+        return NULL;
+    if (_parse_key_size(key_size) < 0)
+        return NULL;
+
+    // Fixed-width keys are hashed in batches with the window kernel
+    if (key_size > 0) {
+        unsigned int digests[HASHXX_SKETCH_BATCH];
+        const char* keys;
+        Py_ssize_t start;
+
+        if (_get_fixed_keys(keys_obj, key_size, &data) < 0)
+            return NULL;
+        keys = (const char*)data.buf;
+        n = data.len / key_size;
+        result = PyList_New(n);
+        for (start = 0; result != NULL && start < n; start += HASHXX_SKETCH_BATCH) {
+            Py_ssize_t batch = n - start < HASHXX_SKETCH_BATCH ? n - start : HASHXX_SKETCH_BATCH;
+            XXH32_windows(keys + start * key_size, batch, key_size, (int)key_size, seed, digests);
+            for (i = 0; i < batch; i++) {
+                PyObject* key = _key_new(type, keys + (start + i) * key_size, key_size, digests[i], seed);
+                if (key == NULL) {
+                    Py_CLEAR(result);
+                    break;
+                }
+                PyList_SET_ITEM(result, start + i, key);
+            }
+        }
+        STATS_CALL(STATS_KEY, data.len);
+        STATS_KERNEL(STATS_KERNEL_XXH32_WINDOWS);
+        PyBuffer_Release(&data);
+        return result;
+    }
+
+    seq = _sequence_fast(keys_obj, "Key.many() expects an iterable of keys.");
+    if (seq == NULL)
+        return NULL;
+    n = PySequence_Fast_GET_SIZE(seq);
+    result = PyList_New(n);
+    for (i = 0; result != NULL && i < n; i++) {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, i), *key;
+
+        if (Py_TYPE(item) == type && ((KeyObject*)item)->seed == seed) {
+            Py_INCREF(item);
+            PyList_SET_ITEM(result, i, item);
+            continue;
+        }
+        if (_get_input_buffer(item, &data) < 0) {
+            Py_CLEAR(result);
+            break;
+        }
+        if (data.len > INT_MAX) {
+            PyErr_SetString(PyExc_ValueError, "Keys must be shorter than 2**31 bytes.");
+            key = NULL;
+        }
+        else {
+            key = _key_new(type, (const char*)data.buf, data.len, _buffer_digest(&data, seed), seed);
+        }
+        nbytes += data.len;
+        PyBuffer_Release(&data);
+        if (key == NULL) {
+            Py_CLEAR(result);
+            break;
+        }
+        PyList_SET_ITEM(result, i, key);
+    }
+    Py_DECREF(seq);
+    STATS_CALL(STATS_KEY, nbytes);
+    STATS_KERNEL(STATS_KERNEL_XXH32);
+    return result;
+}
+
+static Py_hash_t
+Key_hash(KeyObject* self)
+{
+    Py_hash_t hash = (Py_hash_t)self->digest;
+    // -1 is reserved for errors, which only matters with a 32-bit Py_hash_t
+    return hash == -1 ? -2 : hash;
+}
+
+static PyObject *
+Key_richcompare(PyObject* a, PyObject* b, int op)
+{
+    KeyObject *x = (KeyObject*)a, *y = (KeyObject*)b;
+    Py_ssize_t len;
+    int cmp;
+
+    // Keys only compare to Keys, as an equal bytes object hashes differently
+    if (! Key_Check(a) || ! Key_Check(b)) {
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
+    }
+    if (op == Py_EQ || op == Py_NE) {
+        int equal = x == y || (x->digest == y->digest && x->seed == y->seed &&
+                               Py_SIZE(x) == Py_SIZE(y) && memcmp(x->data, y->data, Py_SIZE(x)) == 0);
+        return PyBool_FromLong(op == Py_EQ ? equal : ! equal);
+    }
+
+    len = Py_SIZE(x) < Py_SIZE(y) ? Py_SIZE(x) : Py_SIZE(y);
+    cmp = memcmp(x->data, y->data, len);
+    if (cmp == 0)
+        cmp = Py_SIZE(x) < Py_SIZE(y) ? -1 : Py_SIZE(x) > Py_SIZE(y) ? 1 : 0;
+    // Ties break on the seed, so ordering agrees with equality
+    if (cmp == 0)
+        cmp = x->seed < y->seed ? -1 : x->seed > y->seed ? 1 : 0;
+    switch (op) {
+    case Py_LT: return PyBool_FromLong(cmp < 0);
+    case Py_LE: return PyBool_FromLong(cmp <= 0);
+    case Py_GT: return PyBool_FromLong(cmp > 0);
+    default: return PyBool_FromLong(cmp >= 0);
+    }
+}
+
+static Py_ssize_t
+Key_length(KeyObject* self)
+{
+    return Py_SIZE(self);
+}
+
+static int
+Key_getbuffer(KeyObject* self, Py_buffer* view, int flags)
+{
+    return PyBuffer_FillInfo(view, (PyObject*)self, self->data, Py_SIZE(self), 1, flags);
+}
+
+static PyObject *
+Key_repr(KeyObject* self)
+{
+    PyObject *data, *data_repr, *result;
+
+    data = PyBytes_FromStringAndSize(self->data, Py_SIZE(self));
+    if (data == NULL)
+        return NULL;
+    data_repr = PyObject_Repr(data);
+    Py_DECREF(data);
+    if (data_repr == NULL)
+        return NULL;
+#if PY_MAJOR_VERSION >= 3
+    if (self->seed != 0)
+        result = PyUnicode_FromFormat("Key(%U, seed=%u)", data_repr, self->seed);
+    else
+        result = PyUnicode_FromFormat("Key(%U)", data_repr);
+#else
+    if (self->seed != 0)
+        result = PyString_FromFormat("Key(%s, seed=%u)", PyString_AS_STRING(data_repr), self->seed);
+    else
+        result = PyString_FromFormat("Key(%s)", PyString_AS_STRING(data_repr));
+#endif
+    Py_DECREF(data_repr);
+    return result;
+}
+
+static PyObject *
+Key_reduce(KeyObject* self)
+{
+    PyObject* data = PyBytes_FromStringAndSize(self->data, Py_SIZE(self));
+    if (data == NULL)
+        return NULL;
+    return Py_BuildValue("(O(NI))", Py_TYPE(self), data, self->seed);
+}
+
+static PyObject *
+Key_get_digest(KeyObject* self, void* closure)
+{
+    return PyLong_FromUnsignedLong(self->digest);
+}
+
+static PyObject *
+Key_get_seed(KeyObject* self, void* closure)
+{
+    return PyLong_FromUnsignedLong(self->seed);
+}
+
+static PyMethodDef Key_methods[] = {
+    {"many", (PyCFunction)Key_many, METH_VARARGS | METH_KEYWORDS | METH_CLASS,
+     "many(keys, seed=0, key_size=0)\n\n"
+     "Return a list of Keys, one for each bytes-like object of an iterable. With\n"
+     "key_size, keys is instead a bytes-like object holding keys of key_size bytes\n"
+     "back to back."
+    },
+    {"__reduce__", (PyCFunction)Key_reduce, METH_NOARGS, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef Key_getset[] = {
+    {"digest", (getter)Key_get_digest, NULL, "xxHash value of the key, as hashxx(key, seed=key.seed).", NULL},
+    {"seed", (getter)Key_get_seed, NULL, "Seed the key was hashed with.", NULL},
+    {NULL}  /* Sentinel */
+};
+
+#define Key_doc \
+    "Key(data, seed=0)\n\n" \
+    "Immutable byte string whose xxHash value is computed once and used as its\n" \
+    "hash. Keys support the buffer protocol and compare equal only to Keys with\n" \
+    "the same contents and seed."
+
+#ifdef HAVE_MULTI_PHASE_INIT
+
+static PyType_Slot Key_slots[] = {
+    {Py_tp_dealloc, Key_dealloc},
+    {Py_tp_doc, Key_doc},
+    {Py_tp_repr, Key_repr},
+    {Py_tp_hash, Key_hash},
+    {Py_tp_richcompare, Key_richcompare},
+    {Py_tp_methods, Key_methods},
+    {Py_tp_getset, Key_getset},
+    {Py_tp_new, Key_new},
+    {Py_sq_length, Key_length},
+#ifdef Py_bf_getbuffer
+    {Py_bf_getbuffer, Key_getbuffer},
+#endif
+    {0, NULL}
+};
+
+static PyType_Spec Key_spec = {
+    "pyhashxx.Key",
+    offsetof(KeyObject, data) + 1,
+    1,
+    Py_TPFLAGS_DEFAULT,
+    Key_slots
+};
+
+#else
+
+static PySequenceMethods Key_as_sequence = {
+    (lenfunc)Key_length,                /* sq_length */
+};
+
+static PyBufferProcs Key_as_buffer = {
+#if PY_MAJOR_VERSION < 3
+    0,                                  /* bf_getreadbuffer */
+    0,                                  /* bf_getwritebuffer */
+    0,                                  /* bf_getsegcount */
+    0,                                  /* bf_getcharbuffer */
+#endif
+    (getbufferproc)Key_getbuffer,       /* bf_getbuffer */
+    0,                                  /* bf_releasebuffer */
+};
+
+#if PY_MAJOR_VERSION < 3
+#define Key_flags (Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER)
+#else
+#define Key_flags Py_TPFLAGS_DEFAULT
+#endif
+
+static PyTypeObject pyhashxx_KeyType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "pyhashxx.Key",            /*tp_name*/
+    offsetof(KeyObject, data) + 1, /*tp_basicsize*/
+    1,                         /*tp_itemsize*/
+    (destructor)Key_dealloc,   /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    (reprfunc)Key_repr,        /*tp_repr*/
+    0,                         /*tp_as_number*/
+    &Key_as_sequence,          /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    (hashfunc)Key_hash,        /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    &Key_as_buffer,            /*tp_as_buffer*/
+    Key_flags,                 /*tp_flags*/
+    Key_doc,                   /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    Key_richcompare,           /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    Key_methods,               /* tp_methods */
+    0,                         /* tp_members */
+    Key_getset,                /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    Key_new,                   /* tp_new */
+};
+
+#endif
+
+
+// Add the counters of every thread into *total.
+static void
+_stats_sum(HashxxStats* total)
+{
+    memset(total, 0, sizeof(HashxxStats));
+#ifndef PYHASHXX_NO_STATS
+    {
+        HashxxStats* stats;
+
+        PyThread_acquire_lock(stats_lock, WAIT_LOCK);
+        _stats_add(total, &stats_retired);
+        for (stats = stats_all; stats != NULL; stats = stats->next)
+            _stats_add(total, stats);
+        PyThread_release_lock(stats_lock);
+    }
+#endif
+}
+
+// Set dict[key] = value, consuming the reference to value.
+static int
+_dict_set_new(PyObject* dict, PyObject* key, PyObject* value)
+{
+    int ret;
+    if (value == NULL)
+        return -1;
+    ret = PyDict_SetItem(dict, key, value);
+    Py_DECREF(value);
+    return ret;
+}
+
+static int
+_dict_set_new_str(PyObject* dict, const char* key, PyObject* value)
+{
+    int ret;
+    if (value == NULL)
+        return -1;
+    ret = PyDict_SetItemString(dict, key, value);
+    Py_DECREF(value);
+    return ret;
+}
+
+static PyObject *
+pyhashxx_stats(PyObject* self)
+{
+    HashxxStats total;
+    PyObject *result, *calls, *bytes, *sizes, *kernels;
+    int i, enabled = 0;
+
+#ifndef PYHASHXX_NO_STATS
+    enabled = stats_enabled;
+#endif
+    _stats_sum(&total);
+
+    result = PyDict_New();
+    calls = PyDict_New();
+    bytes = PyDict_New();
+    sizes = PyDict_New();
+    kernels = PyDict_New();
+    if (result == NULL || calls == NULL || bytes == NULL || sizes == NULL || kernels == NULL)
+        goto error;
+
+    for (i = 0; i < STATS_ENTRIES; i++) {
+        if (_dict_set_new_str(calls, stats_entry_names[i], PyLong_FromUnsignedLongLong(total.calls[i])) < 0 ||
+            _dict_set_new_str(bytes, stats_entry_names[i], PyLong_FromUnsignedLongLong(total.bytes[i])) < 0)
+            goto error;
+    }
+    for (i = 0; i < STATS_SIZE_BUCKETS; i++) {
+        PyObject* bound;
+        if (total.sizes[i] == 0)
+            continue;
+        bound = PyLong_FromUnsignedLongLong(i ? 1ULL << (i - 1) : 0);
+        if (bound == NULL)
+            goto error;
+        if (_dict_set_new(sizes, bound, PyLong_FromUnsignedLongLong(total.sizes[i])) < 0) {
+            Py_DECREF(bound);
+            goto error;
+        }
+        Py_DECREF(bound);
+    }
+    for (i = 0; i < STATS_KERNELS; i++) {
+        if (_dict_set_new_str(kernels, stats_kernel_names[i], PyLong_FromUnsignedLongLong(total.kernels[i])) < 0)
+            goto error;
+    }
+
+    if (_dict_set_new_str(result, "enabled", PyBool_FromLong(enabled)) < 0 ||
+        PyDict_SetItemString(result, "calls", calls) < 0 ||
+        PyDict_SetItemString(result, "bytes", bytes) < 0 ||
+        PyDict_SetItemString(result, "sizes", sizes) < 0 ||
+        PyDict_SetItemString(result, "kernels", kernels) < 0 ||
+        _dict_set_new_str(result, "gil_released_ns", PyLong_FromUnsignedLongLong(total.gil_released_ns)) < 0)
+        goto error;
+
+    Py_DECREF(calls);
+    Py_DECREF(bytes);
+    Py_DECREF(sizes);
+    Py_DECREF(kernels);
+    return result;
+
+error:
+    Py_XDECREF(result);
+    Py_XDECREF(calls);
+    Py_XDECREF(bytes);
+    Py_XDECREF(sizes);
+    Py_XDECREF(kernels);
+    return NULL;
+}
+
+static PyObject *
+pyhashxx_reset_stats(PyObject* self)
+{
+#ifndef PYHASHXX_NO_STATS
+    HashxxStats* stats;
+
+    PyThread_acquire_lock(stats_lock, WAIT_LOCK);
+    memset(&stats_retired, 0, sizeof(HashxxStats));
+    for (stats = stats_all; stats != NULL; stats = stats->next) {
+        HashxxStats* next = stats->next;
+        memset(stats, 0, sizeof(HashxxStats));
+        stats->next = next;
+    }
+    PyThread_release_lock(stats_lock);
+#endif
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+pyhashxx_enable_stats(PyObject* self, PyObject *args, PyObject *kwds)
+{
+    int enable = 1;
+    static char *kwlist[] = {"enable", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|i", kwlist,
+            &enable))
+        return NULL;
+
+#ifndef PYHASHXX_NO_STATS
+    stats_enabled = enable != 0;
+#else
+    if (enable) {
+        PyErr_SetString(PyExc_RuntimeError, "pyhashxx was built without statistics support (PYHASHXX_NO_STATS).");
+        return NULL;
+    }
+#endif
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef pyhashxx_methods[] = {
+    {"hashxx", (PyCFunction)pyhashxx_hashxx, METH_VARARGS | METH_KEYWORDS,
+     "Compute the xxHash value for the given value, optionally providing a seed."
+    },
+    {"hash_stream", (PyCFunction)pyhashxx_hash_stream, METH_VARARGS | METH_KEYWORDS,
+     "hash_stream(iterable_or_readable, seed=0, bufsize=65536)\n\n"
+     "Compute the xxHash value of all the data of a file-like object, read\n"
+     "bufsize bytes at a time, or of every chunk produced by an iterable."
+    },
+    {"hash_windows", (PyCFunction)pyhashxx_hash_windows, METH_VARARGS | METH_KEYWORDS,
+     "hash_windows(buffer, window, step=1, seed=0, out=None, winnow=0)\n\n"
+     "Compute the xxHash value of every window-byte window of buffer, starting\n"
+     "every step bytes, into an array('I') (or into out, if given).\n"
+     "With winnow=w, instead return the winnowed fingerprints as a list of\n"
+     "(offset, digest) pairs: the minimum digest of every w consecutive windows."
+    },
+    {"hash_blocks", (PyCFunction)pyhashxx_hash_blocks, METH_VARARGS | METH_KEYWORDS,
+     "hash_blocks(buffer_or_file, block_size, seed=0, threads=1, out=None)\n\n"
+     "Compute the xxHash value of every block_size-byte block of a bytes-like or\n"
+     "file-like object into an array('I') (or into out, if given). The last block\n"
+     "may be short. Blocks are hashed on the given number of native threads."
+    },
+    {"verify_blocks", (PyCFunction)pyhashxx_verify_blocks, METH_VARARGS | METH_KEYWORDS,
+     "verify_blocks(buffer_or_file, block_size, expected, seed=0, threads=1)\n\n"
+     "Hash blocks like hash_blocks() and compare them to the expected digests.\n"
+     "Return the sorted list of indices of blocks that don't match, including\n"
+     "blocks that are missing from either side."
+    },
+    {"build_index", (PyCFunction)pyhashxx_build_index, METH_VARARGS | METH_KEYWORDS,
+     "build_index(file, items, seed=0)\n\n"
+     "Write an index mapping byte keys to unsigned 64-bit values to a binary file,\n"
+     "to be opened with HashIndex. items is a mapping or an iterable of\n"
+     "(key, value) pairs; later duplicates of a key win. Returns the number of\n"
+     "entries written."
+    },
+    {"stats", (PyCFunction)pyhashxx_stats, METH_NOARGS,
+     "Return a dict of usage statistics summed over all threads: calls and bytes\n"
+     "per entry point, a histogram of input sizes keyed by bucket lower bound,\n"
+     "calls per hashing kernel and nanoseconds spent with the GIL released."
+    },
+    {"reset_stats", (PyCFunction)pyhashxx_reset_stats, METH_NOARGS,
+     "Zero all usage statistics."
+    },
+    {"enable_stats", (PyCFunction)pyhashxx_enable_stats, METH_VARARGS | METH_KEYWORDS,
+     "enable_stats(enable=True)\n\n"
+     "Turn recording of usage statistics on or off. Recording is off by default."
+    },
+    {NULL}  /* Sentinel */
+};
+
+
+
+// Statistics are process-wide, so the first interpreter to load the
+// module allocates their lock. Others may be loading it concurrently.
+static int
+_stats_init(void)
+{
+#ifndef PYHASHXX_NO_STATS
+    PyThread_type_lock lock;
+
+    if (stats_lock != NULL)
+        return 0;
+    lock = PyThread_allocate_lock();
+    if (lock == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+#if defined(_MSC_VER)
+    if (InterlockedCompareExchangePointer((PVOID*)&stats_lock, lock, NULL) != NULL)
+#else
+    if (! __sync_bool_compare_and_swap(&stats_lock, NULL, lock))
+#endif
+        PyThread_free_lock(lock);
+#endif
+    return 0;
+}
+
+
+#ifdef HAVE_MULTI_PHASE_INIT
+
+typedef struct {
+    PyObject* HashxxType;
+    PyObject* HashIndexType;
+    PyObject* CountMinSketchType;
+    PyObject* TopKType;
+    PyObject* KeyType;
+} HashxxModuleState;
+
+static HashxxModuleState*
+_get_module_state(PyObject* module)
+{
+    return (HashxxModuleState*)PyModule_GetState(module);
+}
+
+// Create a heap type from spec and add it to the module as name,
+// keeping a reference in *slot.
+static int
+_add_type(PyObject* module, PyType_Spec* spec, const char* name, PyObject** slot)
+{
+    *slot = PyType_FromSpec(spec);
+    if (*slot == NULL)
+        return -1;
+    Py_INCREF(*slot);
+    if (PyModule_AddObject(module, name, *slot) < 0) {
+        Py_DECREF(*slot);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+pyhashxx_exec(PyObject* module)
+{
+    HashxxModuleState* state = _get_module_state(module);
+
+    if (_stats_init() < 0)
+        return -1;
+    if (_add_type(module, &Hashxx_spec, "Hashxx", &state->HashxxType) < 0 ||
+        _add_type(module, &HashIndex_spec, "HashIndex", &state->HashIndexType) < 0 ||
+        _add_type(module, &CountMinSketch_spec, "CountMinSketch", &state->CountMinSketchType) < 0 ||
+        _add_type(module, &TopK_spec, "TopK", &state->TopKType) < 0 ||
+        _add_type(module, &Key_spec, "Key", &state->KeyType) < 0)
+        return -1;
+#ifndef Py_bf_getbuffer
+    // Buffer slots can only be given in a spec from Python 3.9 on
+    ((PyHeapTypeObject*)state->KeyType)->as_buffer.bf_getbuffer = (getbufferproc)Key_getbuffer;
+#endif
+    return 0;
+}
+
+static int
+pyhashxx_traverse(PyObject* module, visitproc visit, void* arg)
+{
+    HashxxModuleState* state = _get_module_state(module);
+    Py_VISIT(state->HashxxType);
+    Py_VISIT(state->HashIndexType);
+    Py_VISIT(state->CountMinSketchType);
+    Py_VISIT(state->TopKType);
+    Py_VISIT(state->KeyType);
+    return 0;
+}
+
+static int
+pyhashxx_clear(PyObject* module)
+{
+    HashxxModuleState* state = _get_module_state(module);
+    Py_CLEAR(state->HashxxType);
+    Py_CLEAR(state->HashIndexType);
+    Py_CLEAR(state->CountMinSketchType);
+    Py_CLEAR(state->TopKType);
+    Py_CLEAR(state->KeyType);
+    return 0;
+}
+
+static void
+pyhashxx_free(void* module)
+{
+    pyhashxx_clear((PyObject*)module);
+}
+
+static PyModuleDef_Slot pyhashxx_slots[] = {
+    {Py_mod_exec, pyhashxx_exec},
+#ifdef Py_mod_multiple_interpreters
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#ifdef Py_mod_gil
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {0, NULL}
+};
+
+static struct PyModuleDef pyhashxx_moduledef = {
+    PyModuleDef_HEAD_INIT,
+    "pyhashxx",
+    "Python wrapper of the xxHash fast hash algorithm.",
+    sizeof(HashxxModuleState),
+    pyhashxx_methods,
+    pyhashxx_slots,
+    pyhashxx_traverse,
+    pyhashxx_clear,
+    pyhashxx_free,
+};
+
+PyMODINIT_FUNC
+PyInit_pyhashxx(void)
+{
+    return PyModuleDef_Init(&pyhashxx_moduledef);
+}
+
+#else
+
+MOD_INIT(pyhashxx) {
+    PyObject* m;
+    MOD_DECL(m, "pyhashxx",
+        "Python wrapper of the xxHash fast hash algorithm.",
+        pyhashxx_methods);
+
+    if (PyType_Ready(&pyhashxx_HashxxType) < 0 ||
+        PyType_Ready(&pyhashxx_HashIndexType) < 0 ||
+        PyType_Ready(&pyhashxx_CountMinSketchType) < 0 ||
+        PyType_Ready(&pyhashxx_TopKType) < 0 ||
+        PyType_Ready(&pyhashxx_KeyType) < 0)
+        RETURN_MOD_INIT_ERROR;
+
+    if (_stats_init() < 0)
+        RETURN_MOD_INIT_ERROR;
+
+    MOD_DEF(m);
+    if (m == NULL)
+        RETURN_MOD_INIT_ERROR;
+
+    Py_INCREF(&pyhashxx_HashxxType);
+    PyModule_AddObject(m, "Hashxx", (PyObject *)&pyhashxx_HashxxType);
+    Py_INCREF(&pyhashxx_HashIndexType);
+    PyModule_AddObject(m, "HashIndex", (PyObject *)&pyhashxx_HashIndexType);
+    Py_INCREF(&pyhashxx_CountMinSketchType);
+    PyModule_AddObject(m, "CountMinSketch", (PyObject *)&pyhashxx_CountMinSketchType);
+    Py_INCREF(&pyhashxx_TopKType);
+    PyModule_AddObject(m, "TopK", (PyObject *)&pyhashxx_TopKType);
+    Py_INCREF(&pyhashxx_KeyType);
+    PyModule_AddObject(m, "Key", (PyObject *)&pyhashxx_KeyType);
+
+    RETURN_MOD_INIT_SUCCESS(m);
+}
+
+#endif
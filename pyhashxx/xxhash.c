@@ -379,3 +379,72 @@ void XXH32_destroy (void* state_in)
 {
     free(state_in);
 }
+
+
+//****************************
+// State Serialization
+//****************************
+
+static void XXH_writeLE32(BYTE* p, U32 v) { p[0]=(BYTE)v; p[1]=(BYTE)(v>>8); p[2]=(BYTE)(v>>16); p[3]=(BYTE)(v>>24); }
+static U32 XXH_readLE32(const BYTE* p) { return (U32)p[0] | ((U32)p[1]<<8) | ((U32)p[2]<<16) | ((U32)p[3]<<24); }
+
+
+void XXH32_exportState(const void* state_in, unsigned char* out)
+{
+    const struct XXH_state32_t * state = (const struct XXH_state32_t *) state_in;
+    XXH_writeLE32(out, state->seed);
+    XXH_writeLE32(out+4, state->v1);
+    XXH_writeLE32(out+8, state->v2);
+    XXH_writeLE32(out+12, state->v3);
+    XXH_writeLE32(out+16, state->v4);
+    XXH_writeLE32(out+20, (U32)state->total_len);
+    XXH_writeLE32(out+24, (U32)(state->total_len >> 32));
+    XXH_writeLE32(out+28, (U32)state->memsize);
+    memset(out+32, 0, 16);
+    memcpy(out+32, state->memory, state->memsize);
+}
+
+
+XXH_errorcode XXH32_importState(void* state_in, const unsigned char* in)
+{
+    struct XXH_state32_t * state = (struct XXH_state32_t *) state_in;
+    U32 seed = XXH_readLE32(in);
+    U64 total_len = (U64)XXH_readLE32(in+20) | ((U64)XXH_readLE32(in+24) << 32);
+    U32 memsize = XXH_readLE32(in+28);
+
+    XXH32_resetState(state, seed);
+
+    // Updates only ever buffer the bytes that don't fill a 16-byte stripe
+    if (memsize != (U32)(total_len & 15)) return XXH_ERROR;
+
+    // Until the first stripe is consumed the accumulators must be untouched
+    if (total_len < 16 &&
+        (XXH_readLE32(in+4) != state->v1 || XXH_readLE32(in+8) != state->v2 ||
+         XXH_readLE32(in+12) != state->v3 || XXH_readLE32(in+16) != state->v4))
+        return XXH_ERROR;
+
+    state->v1 = XXH_readLE32(in+4);
+    state->v2 = XXH_readLE32(in+8);
+    state->v3 = XXH_readLE32(in+12);
+    state->v4 = XXH_readLE32(in+16);
+    state->total_len = total_len;
+    state->memsize = (int)memsize;
+    memcpy(state->memory, in+32, memsize);
+    return OK;
+}
+
+
+//****************************
+// Batch Hash Functions
+//****************************
+
+void XXH32_windows(const void* input, size_t count, size_t step, int window, U32 seed, U32* out)
+{
+    const BYTE* const base = (const BYTE*)input;
+    size_t i;
+
+    // One XXH32() per window. A window's four accumulators already
+    // overlap, and interleaving several windows measured slower.
+    for (i=0; i<count; i++)
+        out[i] = XXH32(base + i * step, window, seed);
+}
@@ -59,6 +59,8 @@ It depends on successfully passing SMHasher test set.
 
 #pragma once
 
+#include <stddef.h>    // for size_t
+
 #if defined (__cplusplus)
 extern "C" {
 #endif
@@ -136,6 +138,51 @@ This pointer must be provided as 'state_in' into XXH32_resetState(), which initi
 */
 
 
+
+//****************************
+// State Serialization
+//****************************
+
+#define XXH32_STATE_EXPORT_SIZE 48
+
+void          XXH32_exportState(const void* state, unsigned char* out);
+XXH_errorcode XXH32_importState(void* state, const unsigned char* in);
+
+/*
+These functions convert a hash calculation state to and from a portable
+sequence of XXH32_STATE_EXPORT_SIZE bytes, so a calculation can be stopped
+and resumed later, possibly on another machine :
+
+	bytes  0..3   seed
+	bytes  4..19  accumulators v1, v2, v3, v4
+	bytes 20..27  total length hashed so far
+	bytes 28..31  number of buffered bytes (total length modulo 16)
+	bytes 32..47  buffered bytes, zero padded
+
+All integers are little-endian, whatever the CPU.
+XXH32_importState() overwrites a state allocated with XXH32_init() or
+XXH32_sizeofState(). It returns XXH_ERROR, leaving the state reset to the
+exported seed, if the bytes are not self-consistent.
+*/
+
+
+
+//****************************
+// Batch Hash Functions
+//****************************
+
+void XXH32_windows(const void* input, size_t count, size_t step, int window, unsigned int seed, unsigned int* out);
+
+/*
+XXH32_windows() :
+	Calculate the 32-bits hash of "count" overlapping windows of "window" bytes each.
+	Window i starts at address input + i*step, so the memory between input and
+	input + (count-1)*step + window must be valid.
+	out[i] receives exactly XXH32(input + i*step, window, seed).
+	The loop runs in C, so callers avoid per-window call and slicing overhead.
+*/
+
+
 #if defined (__cplusplus)
 }
 #endif
@@ -1,3 +1,4 @@
+import os
 from setuptools import find_packages, setup, Extension
 
 headers = [  'pyhashxx/xxhash.h',
@@ -6,7 +7,12 @@ headers = [  'pyhashxx/xxhash.h',
 sources = [ 'pyhashxx/xxhash.c',
             'pyhashxx/pyhashxx.c',
         ]
-pyhashxx = Extension('pyhashxx', sources=sources, depends=headers)
+# Set PYHASHXX_NO_STATS=1 to compile out pyhashxx.stats() recording entirely
+define_macros = []
+if os.environ.get('PYHASHXX_NO_STATS'):
+    define_macros.append(('PYHASHXX_NO_STATS', '1'))
+pyhashxx = Extension('pyhashxx', sources=sources, depends=headers,
+                     define_macros=define_macros)
 
 setup(
     name = "pyhashxx",
@@ -0,0 +1,92 @@
+from __future__ import unicode_literals
+from pyhashxx import hashxx, hash_blocks, verify_blocks
+import array
+import io
+import unittest
+
+class TestHashBlocks(unittest.TestCase):
+    data = bytes(bytearray(range(256))) * 40 + b'tail'
+
+    # Every block should hash exactly like slicing it out and hashing it:
+    def slow_blocks(self, data, block_size, seed=0):
+        return [hashxx(data[i:i+block_size], seed=seed)
+                for i in range(0, len(data), block_size)]
+
+    def test_buffer(self):
+        for block_size in (1, 100, 1024, 4096, len(self.data), 100000):
+            for threads in (1, 3, 8):
+                self.assertEqual(list(hash_blocks(self.data, block_size, threads=threads)),
+                                 self.slow_blocks(self.data, block_size))
+
+    def test_file(self):
+        for block_size in (7, 1024, 100000):
+            for threads in (1, 4):
+                expected = self.slow_blocks(self.data, block_size)
+                self.assertEqual(list(hash_blocks(io.BytesIO(self.data), block_size, threads=threads)),
+                                 expected)
+                reader = io.BufferedReader(io.BytesIO(self.data))
+                self.assertEqual(list(hash_blocks(reader, block_size, threads=threads)),
+                                 expected)
+
+    def test_read_only_file(self):
+        # Objects without readinto() fall back to read()
+        class Reader(object):
+            def __init__(self, data):
+                self.f = io.BytesIO(data)
+            def read(self, n):
+                return self.f.read(min(n, 100))
+        self.assertEqual(list(hash_blocks(Reader(self.data), 1000)),
+                         self.slow_blocks(self.data, 1000))
+
+    def test_overreporting_readinto(self):
+        # A broken readinto() claiming more bytes than fit in the buffer
+        # must not make blocks run past it
+        class Reader(object):
+            def __init__(self, data):
+                self.f = io.BytesIO(data)
+            def readinto(self, b):
+                chunk = self.f.read(len(b))
+                b[:len(chunk)] = chunk
+                return len(chunk) * 50000 if chunk else 0
+        for threads in (1, 4):
+            digests = list(hash_blocks(Reader(self.data), 1000, threads=threads))
+            self.assertTrue(len(digests) >= len(self.data) // 1000)
+            self.assertEqual(digests[:len(self.data) // 1000],
+                             self.slow_blocks(self.data, 1000)[:len(self.data) // 1000])
+            verify_blocks(Reader(self.data), 1000, digests)
+
+    def test_seed(self):
+        self.assertEqual(list(hash_blocks(self.data, 1000, seed=9)),
+                         self.slow_blocks(self.data, 1000, seed=9))
+
+    def test_empty(self):
+        self.assertEqual(list(hash_blocks(b'', 10)), [])
+        self.assertEqual(list(hash_blocks(io.BytesIO(b''), 10)), [])
+
+    def test_out(self):
+        out = array.array('I', [0] * 12)
+        self.assertTrue(hash_blocks(self.data, 1000, out=out) is out)
+        self.assertEqual(list(out[:11]), self.slow_blocks(self.data, 1000))
+        self.assertRaises(ValueError, hash_blocks, self.data, 1000,
+                          out=array.array('I', [0]))
+
+    def test_verify(self):
+        expected = self.slow_blocks(self.data, 1000)
+        self.assertEqual(verify_blocks(self.data, 1000, expected, threads=4), [])
+        self.assertEqual(verify_blocks(self.data, 1000, array.array('I', expected)), [])
+        corrupt = bytearray(self.data)
+        corrupt[2500] ^= 1
+        corrupt[9000] ^= 1
+        self.assertEqual(verify_blocks(bytes(corrupt), 1000, expected), [2, 9])
+        self.assertEqual(verify_blocks(io.BytesIO(bytes(corrupt)), 1000, expected), [2, 9])
+
+    def test_verify_length_mismatch(self):
+        expected = self.slow_blocks(self.data, 1000)
+        self.assertEqual(verify_blocks(self.data, 1000, expected[:-2]), [9, 10])
+        self.assertEqual(verify_blocks(self.data, 1000, expected + [0]), [11])
+
+    def test_bad_args(self):
+        self.assertRaises(ValueError, hash_blocks, self.data, 0)
+        self.assertRaises(ValueError, hash_blocks, self.data, 10, threads=0)
+        self.assertRaises(TypeError, hash_blocks, [1, 2, 3], 10)
+        self.assertRaises(TypeError, hash_blocks, 'hello', 10)
@@ -0,0 +1,99 @@
+from __future__ import unicode_literals
+from pyhashxx import build_index, HashIndex
+import io
+import mmap
+import os
+import shutil
+import sys
+import tempfile
+import unittest
+
+class TestIndex(unittest.TestCase):
+    items = dict((('key%d' % i).encode('ascii'), i * 1000) for i in range(5000))
+
+    def build(self, items, seed=0):
+        f = io.BytesIO()
+        build_index(f, items, seed=seed)
+        return HashIndex(f.getvalue())
+
+    def test_lookup(self):
+        index = self.build(self.items)
+        self.assertEqual(len(index), len(self.items))
+        for key, value in self.items.items():
+            self.assertEqual(index[key], value)
+            self.assertEqual(index.get(key), value)
+            self.assertTrue(key in index)
+        self.assertRaises(KeyError, lambda: index[b'missing'])
+        self.assertEqual(index.get(b'missing'), None)
+        self.assertEqual(index.get(b'missing', -1), -1)
+        self.assertFalse(b'missing' in index)
+
+    def test_get_many(self):
+        index = self.build(self.items)
+        keys = list(self.items) + [b'missing']
+        self.assertEqual(index.get_many(keys, -1),
+                         [self.items[k] for k in keys[:-1]] + [-1])
+        self.assertEqual(index.get_many([]), [])
+
+    def test_pairs_and_duplicates(self):
+        index = self.build([(b'a', 1), (bytearray(b'b'), 2), (b'a', 3), (b'', 2**64 - 1)])
+        self.assertEqual(len(index), 3)
+        self.assertEqual(index[b'a'], 3)
+        self.assertEqual(index[memoryview(b'b')], 2)
+        self.assertEqual(index[b''], 2**64 - 1)
+
+    def test_header(self):
+        index = self.build(self.items, seed=42)
+        self.assertEqual(index.seed, 42)
+        self.assertEqual(index.algorithm, 'XXH32')
+        self.assertEqual(index[b'key7'], 7000)
+
+    def test_empty(self):
+        index = self.build({})
+        self.assertEqual(len(index), 0)
+        self.assertEqual(index.get(b'a'), None)
+
+    def test_mmap(self):
+        tmpdir = tempfile.mkdtemp()
+        try:
+            path = os.path.join(tmpdir, 'test.idx')
+            with open(path, 'wb') as f:
+                build_index(f, self.items)
+            with open(path, 'rb') as f:
+                m = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+                with HashIndex(m) as index:
+                    self.assertEqual(index[b'key4999'], 4999000)
+                self.assertRaises(ValueError, index.get, b'key1')
+                m.close()
+        finally:
+            shutil.rmtree(tmpdir)
+
+    def test_corrupt(self):
+        f = io.BytesIO()
+        build_index(f, self.items)
+        data = f.getvalue()
+        self.assertRaises(ValueError, HashIndex, b'')
+        self.assertRaises(ValueError, HashIndex, b'NOTINDEX' + data[8:])
+        self.assertRaises(ValueError, HashIndex, data[:1000])
+        version = bytearray(data)
+        version[8] = 2
+        self.assertRaises(ValueError, HashIndex, bytes(version))
+
+    def test_bad_items(self):
+        self.assertRaises(TypeError, build_index, io.BytesIO(), [b'a'])
+        self.assertRaises(TypeError, build_index, io.BytesIO(), [('a', 1)])
+        self.assertRaises(OverflowError, build_index, io.BytesIO(), [(b'a', -1)])
+        self.assertRaises(TypeError, self.build({b'a': 1}).get, 'a')
+
+    @unittest.skipIf(sys.maxsize < 2**32, "needs a 64-bit address space")
+    def test_huge_key(self):
+        # Anonymous maps are lazily allocated, so this costs no memory
+        huge = mmap.mmap(-1, 2**31)
+        try:
+            self.assertRaises(ValueError, build_index, io.BytesIO(), [(huge, 1)])
+            index = self.build({b'a': 1})
+            self.assertEqual(index.get(huge), None)
+            self.assertEqual(index.get_many([huge, b'a']), [None, 1])
+            self.assertFalse(huge in index)
+        finally:
+            huge.close()
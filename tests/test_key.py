@@ -0,0 +1,110 @@
+from __future__ import unicode_literals
+from pyhashxx import hashxx, Key, CountMinSketch, TopK, build_index, HashIndex
+import array
+import io
+import pickle
+import unittest
+
+class TestKey(unittest.TestCase):
+    def test_digest(self):
+        for data in (b'', b'a', b'hello world', b'x' * 1000):
+            key = Key(data)
+            self.assertEqual(key.digest, hashxx(data))
+            self.assertEqual(hash(key), key.digest)
+            self.assertEqual(key.seed, 0)
+            self.assertEqual(len(key), len(data))
+        key = Key(b'seeded', seed=12345)
+        self.assertEqual(key.digest, hashxx(b'seeded', seed=12345))
+        self.assertEqual(key.seed, 12345)
+
+    def test_inputs(self):
+        for data in (b'abc', bytearray(b'abc'), memoryview(b'abc'), Key(b'abc')):
+            self.assertEqual(Key(data), Key(b'abc'))
+        self.assertEqual(Key(array.array('B', [1, 2, 3])), Key(b'\x01\x02\x03'))
+        self.assertRaises(TypeError, Key, 'text')
+        self.assertRaises(TypeError, Key, 5)
+
+    def test_shared(self):
+        key = Key(b'abc')
+        self.assertTrue(Key(key) is key)
+        self.assertFalse(Key(key, seed=1) is key)
+        self.assertEqual(Key(key, seed=1).digest, hashxx(b'abc', seed=1))
+
+    def test_buffer(self):
+        key = Key(b'some bytes')
+        self.assertEqual(memoryview(key).tobytes(), b'some bytes')
+        self.assertTrue(memoryview(key).readonly)
+        self.assertEqual(bytearray(key), bytearray(b'some bytes'))
+
+    def test_comparison(self):
+        self.assertEqual(Key(b'a'), Key(b'a'))
+        self.assertNotEqual(Key(b'a'), Key(b'b'))
+        self.assertNotEqual(Key(b'a'), Key(b'a', seed=1))
+        self.assertNotEqual(Key(b'a'), b'a')
+        self.assertTrue(Key(b'a') < Key(b'ab') < Key(b'b'))
+        self.assertTrue(Key(b'b') >= Key(b'a'))
+        # Same contents with different seeds are unequal, so they order by seed
+        self.assertTrue(Key(b'a') < Key(b'a', seed=1))
+        self.assertFalse(Key(b'a', seed=1) <= Key(b'a'))
+        self.assertTrue(Key(b'a') <= Key(b'a') >= Key(b'a'))
+        self.assertTrue(Key(b'a', seed=9) < Key(b'ab'))
+        self.assertEqual(sorted(Key.many([b'c', b'a', b'b'])), Key.many([b'a', b'b', b'c']))
+
+    def test_dict_and_set(self):
+        keys = [('key%d' % i).encode('ascii') for i in range(1000)]
+        d = dict((Key(k), i) for i, k in enumerate(keys))
+        for i, k in enumerate(keys):
+            self.assertEqual(d[Key(k)], i)
+        self.assertFalse(Key(b'missing') in d)
+        self.assertEqual(len(set(Key.many(keys + keys))), len(keys))
+
+    def test_many(self):
+        keys = [('%06d' % i).encode('ascii') for i in range(1000)]
+        from_list = Key.many(keys, seed=3)
+        from_buffer = Key.many(b''.join(keys), seed=3, key_size=6)
+        self.assertEqual(from_list, from_buffer)
+        self.assertEqual([k.digest for k in from_buffer], [hashxx(k, seed=3) for k in keys])
+        self.assertEqual(Key.many([]), [])
+        self.assertEqual(Key.many(b'', key_size=4), [])
+        self.assertRaises(ValueError, Key.many, b'abc', key_size=2)
+        self.assertRaises(TypeError, Key.many, [b'a', 'text'])
+
+    def test_pickle_and_repr(self):
+        for key in (Key(b'abc'), Key(b'\x00\xff', seed=7)):
+            copy = pickle.loads(pickle.dumps(key))
+            self.assertEqual(copy, key)
+            self.assertEqual(copy.seed, key.seed)
+        self.assertEqual(repr(Key(b'abc', seed=7)), "Key(%r, seed=7)" % b'abc')
+
+    def test_immutable(self):
+        key = Key(b'abc')
+        self.assertRaises(AttributeError, setattr, key, 'digest', 0)
+        self.assertRaises(TypeError, memoryview(key).__setitem__, 0, b'x')
+
+    def test_hashing(self):
+        key = Key(b'abc')
+        self.assertEqual(hashxx(key), hashxx(b'abc'))
+        self.assertEqual(hashxx(key, seed=9), hashxx(b'abc', seed=9))
+        self.assertEqual(hashxx(key, b'def'), hashxx(b'abcdef'))
+        self.assertEqual(hashxx((key, Key(b'def', seed=1))), hashxx(b'abcdef'))
+
+    def test_index_and_sketch(self):
+        f = io.BytesIO()
+        build_index(f, [(Key(b'a'), 1), (Key(b'b', seed=2), 2)])
+        index = HashIndex(f.getvalue())
+        self.assertEqual(index[Key(b'a')], 1)
+        self.assertEqual(index[Key(b'b')], 2)
+        self.assertEqual(index.get(Key(b'b', seed=5)), 2)
+        self.assertEqual(index.get_many([Key(b'a'), b'b', Key(b'c')]), [1, 2, None])
+
+        sketch = CountMinSketch(64, 3)
+        sketch.add(Key(b'a'))
+        sketch.add_many([Key(b'a', seed=1), b'a'])
+        self.assertEqual(sketch.estimate(b'a'), 3)
+        top = TopK(2, 64, 3)
+        top.add_many(Key.many([b'a', b'a', b'b']))
+        self.assertTrue(Key(b'a') in top)
+        self.assertEqual(top.items()[0], (b'a', 2))
+
+if __name__ == '__main__':
+    unittest.main()
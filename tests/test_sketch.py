@@ -0,0 +1,227 @@
+from __future__ import unicode_literals
+from pyhashxx import CountMinSketch, TopK
+import array
+import mmap
+import pickle
+import random
+import struct
+import sys
+import unittest
+
+def zipf_keys(n, seed=1):
+    # Key i appears roughly 1/i as often as key 1
+    rng = random.Random(seed)
+    keys = [('key%d' % i).encode('ascii') for i in range(1, 1001)]
+    weights = [1.0 / i for i in range(1, 1001)]
+    total = sum(weights)
+    result = []
+    for _ in range(n):
+        x = rng.random() * total
+        for key, weight in zip(keys, weights):
+            x -= weight
+            if x <= 0:
+                break
+        result.append(key)
+    return result
+
+class TestCountMinSketch(unittest.TestCase):
+    stream = zipf_keys(20000)
+
+    def counts(self):
+        counts = {}
+        for key in self.stream:
+            counts[key] = counts.get(key, 0) + 1
+        return counts
+
+    def test_estimates_bound_true_counts(self):
+        for conservative in (False, True):
+            sketch = CountMinSketch(512, 4, conservative=conservative)
+            for key in self.stream:
+                sketch.add(key)
+            self.assertEqual(sketch.total, len(self.stream))
+            for key, count in self.counts().items():
+                estimate = sketch.estimate(key)
+                self.assertTrue(estimate >= count)
+                # Error is at most e * total / width with high probability
+                self.assertTrue(estimate - count <= 2.72 * len(self.stream) / 512 * 2)
+                self.assertEqual(sketch[key], estimate)
+
+    def test_conservative_is_tighter(self):
+        plain = CountMinSketch(256, 3)
+        conservative = CountMinSketch(256, 3, conservative=True)
+        plain.add_many(self.stream)
+        conservative.add_many(self.stream)
+        counts = self.counts()
+        plain_error = sum(plain.estimate(k) - c for k, c in counts.items())
+        conservative_error = sum(conservative.estimate(k) - c for k, c in counts.items())
+        self.assertTrue(conservative_error <= plain_error)
+
+    def test_add(self):
+        sketch = CountMinSketch(1000, 5, seed=7)
+        self.assertEqual(sketch.estimate(b'a'), 0)
+        self.assertEqual(sketch.add(b'a'), 1)
+        self.assertEqual(sketch.add(bytearray(b'a'), 5), 6)
+        self.assertEqual(sketch.add(memoryview(b'a'), count=0), 6)
+        self.assertEqual(sketch.total, 6)
+        self.assertEqual((sketch.width, sketch.depth, sketch.seed, sketch.conservative),
+                         (1000, 5, 7, False))
+
+    def test_add_many_fixed_width(self):
+        keys = [('%08d' % (i % 37)).encode('ascii') for i in range(5000)]
+        from_list = CountMinSketch(128, 4, conservative=True)
+        from_list.add_many(keys, 3)
+        from_buffer = CountMinSketch(128, 4, conservative=True)
+        from_buffer.add_many(b''.join(keys), 3, key_size=8)
+        self.assertEqual(pickle.dumps(from_list), pickle.dumps(from_buffer))
+        for key in set(keys):
+            self.assertEqual(from_buffer.estimate(key), from_list.estimate(key))
+
+        ints = array.array('I', range(100))
+        sketch = CountMinSketch(1024, 4)
+        sketch.add_many(ints, key_size=4)
+        self.assertEqual(sketch.total, 100)
+        self.assertTrue(sketch.estimate(struct.pack('=I', 42)) >= 1)
+
+        self.assertRaises(ValueError, sketch.add_many, b'abc', key_size=2)
+        self.assertRaises(ValueError, sketch.add_many, b'abcd', key_size=-1)
+
+    def test_merge(self):
+        whole = CountMinSketch(256, 4)
+        whole.add_many(self.stream)
+        parts = [CountMinSketch(256, 4) for _ in range(4)]
+        for i, key in enumerate(self.stream):
+            parts[i % 4].add(key)
+        for part in parts[1:]:
+            parts[0].merge(part)
+        self.assertEqual(parts[0].total, whole.total)
+        self.assertEqual(pickle.dumps(parts[0]), pickle.dumps(whole))
+
+        self.assertRaises(ValueError, whole.merge, CountMinSketch(128, 4))
+        self.assertRaises(ValueError, whole.merge, CountMinSketch(256, 4, seed=1))
+        self.assertRaises(TypeError, whole.merge, TopK(10, 256, 4))
+
+    def test_pickle(self):
+        sketch = CountMinSketch(100, 3, seed=3, conservative=True)
+        sketch.add_many(self.stream[:1000])
+        copy = pickle.loads(pickle.dumps(sketch))
+        self.assertEqual((copy.width, copy.depth, copy.seed, copy.conservative, copy.total),
+                         (100, 3, 3, True, 1000))
+        for key in set(self.stream[:1000]):
+            self.assertEqual(copy.estimate(key), sketch.estimate(key))
+
+    def test_errors(self):
+        self.assertRaises(ValueError, CountMinSketch, 0, 4)
+        self.assertRaises(ValueError, CountMinSketch, 16, 0)
+        self.assertRaises(ValueError, CountMinSketch, 2**40, 1)
+        sketch = CountMinSketch(16, 2)
+        self.assertRaises(TypeError, sketch.add, 'text')
+        self.assertRaises(ValueError, sketch.add, b'a', -1)
+        self.assertRaises(TypeError, sketch.add_many, [b'a', 1])
+        self.assertEqual(sketch.estimate(b'a'), 1)
+        self.assertRaises(ValueError, sketch.__setstate__, b'short')
+
+    @unittest.skipIf(sys.maxsize < 2**32, "needs a 64-bit address space")
+    def test_huge_key(self):
+        # Anonymous maps are lazily allocated, so this costs no memory
+        huge = mmap.mmap(-1, 2**32 + 5)
+        try:
+            sketch = CountMinSketch(16, 2)
+            self.assertRaises(ValueError, sketch.add, huge)
+            self.assertRaises(ValueError, sketch.add_many, [b'a', huge])
+            self.assertRaises(ValueError, sketch.estimate, huge)
+            self.assertEqual(sketch.total, 1)
+            top = TopK(2, 16, 2)
+            self.assertRaises(ValueError, top.add, huge)
+            self.assertRaises(ValueError, top.add_many, [huge])
+            self.assertRaises(ValueError, top.estimate, huge)
+            self.assertRaises(ValueError, top.__contains__, huge)
+            self.assertEqual(top.items(), [])
+        finally:
+            huge.close()
+
+class TestTopK(unittest.TestCase):
+    stream = zipf_keys(20000)
+
+    def true_top(self, n):
+        counts = {}
+        for key in self.stream:
+            counts[key] = counts.get(key, 0) + 1
+        return sorted(counts, key=lambda k: -counts[k])[:n]
+
+    def test_heavy_hitters(self):
+        top = TopK(10, 1024, 4)
+        for key in self.stream:
+            top.add(key)
+        self.assertEqual(len(top), 10)
+        items = top.items()
+        self.assertEqual(len(items), 10)
+        counts = [count for _, count in items]
+        self.assertEqual(counts, sorted(counts, reverse=True))
+        self.assertEqual(set(k for k, _ in items[:5]), set(self.true_top(5)))
+        for key, count in items:
+            self.assertTrue(key in top)
+            self.assertEqual(top.estimate(key), count)
+        self.assertFalse(b'key999' in top)
+        self.assertEqual(top.total, len(self.stream))
+        self.assertEqual((top.k, top.width, top.depth, top.conservative), (10, 1024, 4, True))
+
+    def test_fewer_than_k(self):
+        top = TopK(5, 64, 2)
+        self.assertEqual(top.items(), [])
+        top.add_many([b'a', b'b', b'a'])
+        top.add(bytearray(b'c'), 10)
+        self.assertEqual(top.items(), [(b'c', 10), (b'a', 2), (b'b', 1)])
+        self.assertTrue(isinstance(top.items()[0][0], bytes))
+
+    def test_add_many_fixed_width(self):
+        keys = [('%04d' % (i % 97 if i % 3 else 1)).encode('ascii') for i in range(5000)]
+        from_list = TopK(8, 512, 4)
+        from_list.add_many(keys)
+        from_buffer = TopK(8, 512, 4)
+        from_buffer.add_many(b''.join(keys), key_size=4)
+        self.assertEqual(from_list.items(), from_buffer.items())
+        self.assertEqual(from_buffer.items()[0][0], b'0001')
+
+    def test_merge(self):
+        whole = TopK(10, 1024, 4, conservative=False)
+        whole.add_many(self.stream)
+        parts = [TopK(10, 1024, 4, conservative=False) for _ in range(3)]
+        for i, key in enumerate(self.stream):
+            parts[i % 3].add(key)
+        parts[0].merge(parts[1])
+        parts[0].merge(parts[2])
+        self.assertEqual(parts[0].total, whole.total)
+        merged = dict(parts[0].items())
+        for key in self.true_top(5):
+            self.assertEqual(merged[key], whole.estimate(key))
+        self.assertRaises(ValueError, whole.merge, TopK(10, 512, 4))
+        self.assertRaises(TypeError, whole.merge, CountMinSketch(1024, 4))
+
+    def test_eviction_keeps_table_consistent(self):
+        top = TopK(3, 4096, 4)
+        for i in range(2000):
+            top.add(('k%d' % i).encode('ascii'), i % 50 + 1)
+        items = top.items()
+        self.assertEqual(len(items), 3)
+        for key, count in items:
+            self.assertTrue(key in top)
+        self.assertEqual(sum(1 for i in range(2000) if ('k%d' % i).encode('ascii') in top), 3)
+
+    def test_pickle(self):
+        top = TopK(10, 256, 3, seed=5)
+        top.add_many(self.stream[:2000])
+        copy = pickle.loads(pickle.dumps(top))
+        self.assertEqual(copy.items(), top.items())
+        self.assertEqual((copy.k, copy.seed, copy.total), (10, 5, 2000))
+        copy.add(b'key1')
+        self.assertEqual(copy.estimate(b'key1'), top.estimate(b'key1') + 1)
+
+    def test_errors(self):
+        self.assertRaises(ValueError, TopK, 0, 16, 2)
+        self.assertRaises(ValueError, TopK, 1, 0, 2)
+        top = TopK(2, 16, 2)
+        self.assertRaises(TypeError, top.add, 'text')
+        self.assertRaises(ValueError, top.add, b'a', -1)
+
+if __name__ == '__main__':
+    unittest.main()
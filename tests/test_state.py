@@ -0,0 +1,82 @@
+from __future__ import unicode_literals
+from pyhashxx import hashxx, Hashxx
+import copy
+import pickle
+import struct
+import unittest
+
+class TestState(unittest.TestCase):
+    data = bytes(bytearray(range(256)))
+
+    def test_resume(self):
+        # Split at every offset to cover all buffered-byte counts
+        for split in range(0, 50):
+            h = Hashxx(seed=3)
+            h.update(self.data[:split])
+            resumed = Hashxx.from_state(h.export_state())
+            resumed.update(self.data[split:])
+            self.assertEqual(resumed.digest(), hashxx(self.data, seed=3))
+
+    def test_export_is_independent(self):
+        h = Hashxx()
+        h.update(b'hello')
+        state = h.export_state()
+        h.update(b'world')
+        self.assertEqual(Hashxx.from_state(state).digest(), hashxx(b'hello'))
+
+    def test_stable_format(self):
+        # Before the first 16-byte stripe the accumulators hold their
+        # seed-derived initial values
+        seed = 1
+        mask = 0xFFFFFFFF
+        accumulators = ((seed + 2654435761 + 2246822519) & mask,
+                        (seed + 2246822519) & mask,
+                        seed,
+                        (seed - 2654435761) & mask)
+        h = Hashxx(seed=seed)
+        h.update(b'hello')
+        self.assertEqual(h.export_state(),
+                         b'hXX\x01' + struct.pack('<5IQI', seed, *accumulators + (5, 5)) +
+                         b'hello' + b'\x00' * 11)
+
+    def test_pickle(self):
+        h = Hashxx(seed=5)
+        h.update(self.data[:21])
+        for protocol in range(pickle.HIGHEST_PROTOCOL + 1):
+            resumed = pickle.loads(pickle.dumps(h, protocol))
+            resumed.update(self.data[21:])
+            self.assertEqual(resumed.digest(), hashxx(self.data, seed=5))
+
+    def test_copy(self):
+        h = Hashxx()
+        h.update(b'hello')
+        c = copy.copy(h)
+        c.update(b'world')
+        self.assertEqual(h.digest(), hashxx(b'hello'))
+        self.assertEqual(c.digest(), hashxx(b'helloworld'))
+
+    def test_bad_state(self):
+        state = bytearray(Hashxx().export_state())
+        self.assertRaises(ValueError, Hashxx.from_state, b'')
+        self.assertRaises(ValueError, Hashxx.from_state, b'nope' + bytes(state[4:]))
+        self.assertRaises(ValueError, Hashxx.from_state, bytes(state[:-1]))
+        bad_version = bytearray(state)
+        bad_version[3] = 99
+        self.assertRaises(ValueError, Hashxx.from_state, bytes(bad_version))
+        # Buffered byte count inconsistent with the total length
+        corrupt = bytearray(state)
+        corrupt[32] = 3
+        self.assertRaises(ValueError, Hashxx.from_state, bytes(corrupt))
+
+    def test_uninitialized(self):
+        h = Hashxx.__new__(Hashxx)
+        self.assertRaises(ValueError, h.export_state)
+        self.assertRaises(ValueError, h.digest)
+        self.assertRaises(ValueError, h.update, b'data')
+        self.assertRaises(ValueError, h.update_from, [b'data'])
+        self.assertRaises(ValueError, pickle.dumps, h)
+        h.__setstate__(Hashxx().export_state())
+        self.assertEqual(h.digest(), hashxx(b''))
+
+    def test_no_unicode(self):
+        self.assertRaises(TypeError, Hashxx.from_state, 'hXX')
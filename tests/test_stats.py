@@ -0,0 +1,128 @@
+from __future__ import unicode_literals
+import pyhashxx
+from pyhashxx import hashxx, Hashxx, hash_windows, build_index, HashIndex
+import io
+import threading
+import unittest
+
+def stats_compiled_in():
+    try:
+        pyhashxx.enable_stats()
+    except RuntimeError:
+        return False
+    pyhashxx.enable_stats(False)
+    return True
+
+class TestStats(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        if not stats_compiled_in():
+            raise unittest.SkipTest('pyhashxx was built with PYHASHXX_NO_STATS')
+
+    def setUp(self):
+        pyhashxx.enable_stats()
+        pyhashxx.reset_stats()
+
+    def tearDown(self):
+        pyhashxx.enable_stats(False)
+        pyhashxx.reset_stats()
+
+    def test_disabled_by_default_records_nothing(self):
+        pyhashxx.enable_stats(False)
+        hashxx(b'hello')
+        stats = pyhashxx.stats()
+        self.assertFalse(stats['enabled'])
+        self.assertEqual(stats['calls']['hashxx.fast'], 0)
+
+    def test_fast_and_slow_paths(self):
+        hashxx(b'hello')
+        hashxx(b'hello', b'world')
+        hashxx((b'hello', b'world'))
+        stats = pyhashxx.stats()
+        self.assertTrue(stats['enabled'])
+        self.assertEqual(stats['calls']['hashxx.fast'], 1)
+        self.assertEqual(stats['bytes']['hashxx.fast'], 5)
+        self.assertEqual(stats['calls']['hashxx.slow'], 2)
+        self.assertEqual(stats['bytes']['hashxx.slow'], 20)
+        self.assertEqual(stats['kernels']['XXH32'], 1)
+        self.assertEqual(stats['kernels']['XXH32_update'], 4)
+
+    def test_incremental(self):
+        h = Hashxx()
+        h.update(b'hello')
+        h.update(b'world', b'!')
+        h.digest()
+        stats = pyhashxx.stats()
+        self.assertEqual(stats['calls']['Hashxx.update'], 2)
+        self.assertEqual(stats['bytes']['Hashxx.update'], 11)
+        self.assertEqual(stats['calls']['Hashxx.digest'], 1)
+
+    def test_size_histogram(self):
+        hashxx(b'')
+        hashxx(b'a')
+        hashxx(b'abc')
+        hashxx(b'x' * 1000)
+        self.assertEqual(pyhashxx.stats()['sizes'], {0: 1, 1: 1, 2: 1, 512: 1})
+
+    def test_gil_released_time(self):
+        hash_windows(b'x' * 100000, 64)
+        stats = pyhashxx.stats()
+        self.assertEqual(stats['calls']['hash_windows'], 1)
+        self.assertEqual(stats['kernels']['XXH32_windows'], 1)
+        self.assertTrue(stats['gil_released_ns'] > 0)
+
+    def test_index_lookups_per_key(self):
+        f = io.BytesIO()
+        build_index(f, {b'a': 1, b'bb': 2})
+        index = HashIndex(f.getvalue())
+        pyhashxx.reset_stats()
+        index.get(b'a')
+        index.get_many([b'a', b'bb', b'missing'])
+        stats = pyhashxx.stats()
+        self.assertEqual(stats['calls']['HashIndex.lookup'], 4)
+        self.assertEqual(stats['bytes']['HashIndex.lookup'], 11)
+        self.assertEqual(stats['kernels']['XXH32'], 4)
+        self.assertEqual(stats['sizes'], {1: 2, 2: 1, 4: 1})
+
+    def test_threads_are_summed(self):
+        def work():
+            for i in range(100):
+                hashxx(b'hello')
+        threads = [threading.Thread(target=work) for i in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertEqual(pyhashxx.stats()['calls']['hashxx.fast'], 400)
+
+    def test_reset(self):
+        hashxx(b'hello')
+        pyhashxx.reset_stats()
+        self.assertEqual(pyhashxx.stats()['calls']['hashxx.fast'], 0)
+
+    def test_exited_threads_are_kept(self):
+        def work():
+            hashxx(b'hello')
+        for i in range(50):
+            t = threading.Thread(target=work)
+            t.start()
+            t.join()
+        self.assertEqual(pyhashxx.stats()['calls']['hashxx.fast'], 50)
+        pyhashxx.reset_stats()
+        self.assertEqual(pyhashxx.stats()['calls']['hashxx.fast'], 0)
+
+class TestNoStats(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        if stats_compiled_in():
+            raise unittest.SkipTest('pyhashxx was built with statistics support')
+
+    def test_recording_unavailable(self):
+        self.assertRaises(RuntimeError, pyhashxx.enable_stats)
+        pyhashxx.enable_stats(False)
+        hashxx(b'hello')
+        stats = pyhashxx.stats()
+        self.assertFalse(stats['enabled'])
+        self.assertEqual(stats['calls']['hashxx.fast'], 0)
@@ -0,0 +1,58 @@
+from __future__ import unicode_literals
+from pyhashxx import hashxx, Hashxx, hash_stream
+import io
+import unittest
+
+class TestStream(unittest.TestCase):
+    data = bytes(bytearray(range(256))) * 100
+
+    def test_readinto(self):
+        for bufsize in (1, 7, 4096, 65536):
+            self.assertEqual(hash_stream(io.BytesIO(self.data), bufsize=bufsize),
+                             hashxx(self.data))
+            reader = io.BufferedReader(io.BytesIO(self.data))
+            self.assertEqual(hash_stream(reader, seed=4, bufsize=bufsize),
+                             hashxx(self.data, seed=4))
+
+    def test_read(self):
+        # Objects without readinto() are read with read()
+        class Reader(object):
+            def __init__(self, data):
+                self.f = io.BytesIO(data)
+            def read(self, n):
+                return self.f.read(min(n, 1000))
+        self.assertEqual(hash_stream(Reader(self.data)), hashxx(self.data))
+
+    def test_iterable(self):
+        chunks = [self.data[i:i+300] for i in range(0, len(self.data), 300)]
+        self.assertEqual(hash_stream(chunks), hashxx(self.data))
+        self.assertEqual(hash_stream(iter(chunks)), hashxx(self.data))
+        self.assertEqual(hash_stream(c for c in chunks), hashxx(self.data))
+        self.assertEqual(hash_stream([bytearray(b'he'), memoryview(b'llo'), (b'wo', b'rld'), None]),
+                         hashxx(b'helloworld'))
+
+    def test_bytes(self):
+        self.assertEqual(hash_stream(self.data), hashxx(self.data))
+
+    def test_empty(self):
+        self.assertEqual(hash_stream([]), hashxx(b''))
+        self.assertEqual(hash_stream(io.BytesIO(b'')), hashxx(b''))
+
+    def test_update_from(self):
+        h = Hashxx(seed=2)
+        h.update(b'header')
+        self.assertEqual(h.update_from(io.BytesIO(self.data), bufsize=1000), len(self.data))
+        self.assertEqual(h.update_from([b'trail', b'er']), 7)
+        self.assertEqual(h.digest(), hashxx(b'header' + self.data + b'trailer', seed=2))
+
+    def test_bad_items(self):
+        self.assertRaises(TypeError, hash_stream, [b'ok', 'unicode'])
+        self.assertRaises(TypeError, hash_stream, [b'ok', 1])
+        self.assertRaises(TypeError, hash_stream, 5)
+        self.assertRaises(ValueError, hash_stream, [], bufsize=0)
+
+    def test_errors_propagate(self):
+        def chunks():
+            yield b'ok'
+            raise KeyError('boom')
+        self.assertRaises(KeyError, hash_stream, chunks())
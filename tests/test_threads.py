@@ -0,0 +1,93 @@
+from __future__ import unicode_literals
+from pyhashxx import hashxx, Hashxx, hash_windows, hash_blocks
+import os
+import sys
+import threading
+import unittest
+
+try:
+    import _testcapi
+except ImportError:
+    _testcapi = None
+
+class TestThreads(unittest.TestCase):
+    threads = 8
+    iterations = 200
+    data = bytes(bytearray(range(256))) * 16
+
+    def run_threads(self, target):
+        errors = []
+        def wrapper():
+            try:
+                target()
+            except Exception as exc:
+                errors.append(exc)
+        threads = [threading.Thread(target=wrapper) for i in range(self.threads)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertEqual(errors, [])
+
+    def test_independent_digests(self):
+        expected = hashxx(self.data, seed=3)
+        expected_windows = list(hash_windows(self.data, 64, step=61))
+        expected_blocks = list(hash_blocks(self.data, 1000))
+        def work():
+            for i in range(self.iterations):
+                self.assertEqual(hashxx(self.data, seed=3), expected)
+                self.assertEqual(hashxx(self.data[:100], self.data[100:], seed=3), expected)
+                h = Hashxx(seed=3)
+                h.update(self.data)
+                self.assertEqual(h.digest(), expected)
+                self.assertEqual(list(hash_windows(self.data, 64, step=61)), expected_windows)
+                self.assertEqual(list(hash_blocks(self.data, 1000, threads=2)), expected_blocks)
+        self.run_threads(work)
+
+    def test_shared_hasher(self):
+        # Every thread appends the same chunk, so the order of updates
+        # doesn't matter but any torn update would change the digest
+        chunk = self.data[:37]
+        h = Hashxx()
+        def work():
+            for i in range(self.iterations):
+                h.update(chunk)
+                h.digest()
+        self.run_threads(work)
+        self.assertEqual(h.digest(), hashxx(chunk * (self.threads * self.iterations)))
+
+    def test_shared_hasher_streams(self):
+        # update_from() releases the GIL while hashing large chunks
+        chunk = self.data * 2
+        h = Hashxx()
+        def work():
+            for i in range(self.iterations // 10):
+                h.update_from([chunk])
+        self.run_threads(work)
+        self.assertEqual(h.digest(), hashxx(chunk * (self.threads * (self.iterations // 10))))
+
+    def test_resized_bytearray(self):
+        # Hashing holds a buffer export, so a concurrent resize either
+        # happens between hashes or fails with BufferError
+        shared = bytearray(self.data)
+        def work():
+            for i in range(self.iterations):
+                try:
+                    if i % 2:
+                        del shared[10:]
+                    else:
+                        shared.extend(self.data)
+                except BufferError:
+                    pass
+                hashxx(shared)
+                Hashxx().update(shared)
+        self.run_threads(work)
+
+    @unittest.skipIf(_testcapi is None or not hasattr(_testcapi, 'run_in_subinterp'),
+                     "subinterpreters not available")
+    def test_subinterpreter(self):
+        path = os.path.dirname(sys.modules['pyhashxx'].__file__)
+        code = ("import sys; sys.path.insert(0, %r); import pyhashxx\n"
+                "h = pyhashxx.Hashxx(); h.update(b'hello')\n"
+                "assert h.digest() == pyhashxx.hashxx(b'hello') == 4211111929\n") % path
+        self.assertEqual(_testcapi.run_in_subinterp(code), 0)
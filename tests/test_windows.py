@@ -0,0 +1,68 @@
+from __future__ import unicode_literals
+from pyhashxx import hashxx, hash_windows
+import array
+import unittest
+
+class TestHashWindows(unittest.TestCase):
+    data = bytes(bytearray(range(256))) * 4
+
+    # Every window should hash exactly like slicing it out and hashing it:
+    def slow_windows(self, data, window, step=1, seed=0):
+        return [hashxx(data[i:i+window], seed=seed)
+                for i in range(0, len(data) - window + 1, step)]
+
+    def test_matches_slices(self):
+        for window in (1, 4, 15, 16, 17, 32, 33, 100):
+            for step in (1, 3, 16):
+                self.assertEqual(list(hash_windows(self.data, window, step=step)),
+                                 self.slow_windows(self.data, window, step))
+
+    def test_seeds(self):
+        self.assertEqual(list(hash_windows(self.data, 20, seed=7)),
+                         self.slow_windows(self.data, 20, seed=7))
+        self.assertNotEqual(list(hash_windows(self.data, 20, seed=7)),
+                            list(hash_windows(self.data, 20, seed=8)))
+
+    def test_short_buffer(self):
+        self.assertEqual(list(hash_windows(b'abc', 4)), [])
+        self.assertEqual(list(hash_windows(b'abcd', 4)), [hashxx(b'abcd')])
+
+    def test_bytearray_and_memoryview(self):
+        expected = self.slow_windows(self.data, 8)
+        self.assertEqual(list(hash_windows(bytearray(self.data), 8)), expected)
+        self.assertEqual(list(hash_windows(memoryview(self.data), 8)), expected)
+
+    def test_out(self):
+        out = array.array('I', [0] * 10)
+        self.assertTrue(hash_windows(b'hello world', 4, out=out) is out)
+        self.assertEqual(list(out[:8]), self.slow_windows(b'hello world', 4))
+        self.assertEqual(list(out[8:]), [0, 0])
+
+    def test_out_too_small(self):
+        self.assertRaises(ValueError, hash_windows, b'hello world', 4,
+                          out=array.array('I', [0]))
+
+    def test_out_wrong_type(self):
+        self.assertRaises(TypeError, hash_windows, b'hello world', 4,
+                          out=bytearray(64))
+
+    def test_winnow(self):
+        digests = self.slow_windows(self.data, 8, step=2)
+        winnowed = hash_windows(self.data, 8, step=2, winnow=4)
+        # Every run of 4 windows must have its minimum selected
+        offsets = set(offset for offset, digest in winnowed)
+        for i in range(len(digests) - 3):
+            run = digests[i:i+4]
+            self.assertTrue(any(2*(i+j) in offsets and digests[i+j] == min(run)
+                                for j in range(4)))
+        for offset, digest in winnowed:
+            self.assertEqual(digest, hashxx(self.data[offset:offset+8]))
+
+    def test_bad_args(self):
+        self.assertRaises(ValueError, hash_windows, b'hello', 0)
+        self.assertRaises(ValueError, hash_windows, b'hello', 2, step=0)
+        self.assertRaises(TypeError, hash_windows, b'hello', 2,
+                          out=array.array('I', [0] * 4), winnow=2)
+
+    def test_no_unicode(self):
+        self.assertRaises(TypeError, hash_windows, 'hello', 2)